@@ -18,8 +18,8 @@
 extern uint8_t CAN_BAUD_RATE_TIMING_MAP[8][4];
 
 // note: to achieve maximum usart speeds, the microcontroller needs to be configured accordingly
-enum UsartBaudRate { USART_Custom = 0, USART_921600_bps, USART_460800_bps, USART_230400_bps, USART_115200_bps };
-enum CanBaudRate { CAN_Custom = 0, CAN_1000_kbps, CAN_500_kbps, CAN_250_kbps, CAN_125_kbps };
+enum UsartBaudRate { USART_Custom = 0, USART_921600_bps, USART_460800_bps, USART_230400_bps, USART_115200_bps, USART_2000000_bps, USART_3000000_bps };
+enum CanBaudRate { CAN_Custom = 0, CAN_1000_kbps, CAN_500_kbps, CAN_250_kbps, CAN_125_kbps, CAN_100_kbps, CAN_50_kbps, CAN_10_kbps };
 
 enum RESET_FLAGS { RESET_TYPE_UNKNOWN = 0, RESET_TYPE_POWER = 1, RESET_TYPE_HARDWARE = 2, RESET_TYPE_WATCHDOG = 3, RESET_TYPE_SOFTWARE = 4 };
 
@@ -32,6 +32,12 @@ extern char * RESET_FLAG_NAMES[5];
 extern uint8_t RESET_FLAG;
 extern char * RESET_FLAG_NAME;
 
+extern uint32_t FLASH_PROGRAM_CYCLES;
+extern uint32_t FLASH_PROGRAM_BYTES;
+
+extern uint32_t CRC_CYCLES;
+extern uint32_t CRC_BYTES;
+
 extern void FLASH_ReadUserData(void);
 extern FLASH_Status FLASH_WriteUserData(void);
 
@@ -39,6 +45,24 @@ extern void FLASH_ReadApplicationData(void);
 
 extern FLASH_Status FLASH_EraseSectors(uint16_t sector, uint16_t end_sector, uint8_t VoltageRange);
 extern uint16_t FLASH_GetSector(uint32_t address);
+extern uint32_t FLASH_GetSectorAddress(uint16_t sector);
+extern uint32_t FLASH_GetEndAddress(void);
+
+extern void FLASH_ProgramStart(FlashProgram_TypeDef * program, uint32_t address, uint8_t * data, uint32_t length);
+extern FLASH_Status FLASH_ProgramContinue(FlashProgram_TypeDef * program, uint32_t words);
+extern FLASH_Status FLASH_ProgramData(uint32_t address, uint8_t * data, uint32_t length);
+extern uint32_t FLASH_GetProgramCyclesPerKB(void);
+
+extern uint32_t CRC_CalcDataCRC(uint32_t address, uint32_t length);
+extern void CRC_CalcBlockCRC_DMA(uint32_t address, uint32_t words);
+extern uint32_t CRC_GetCyclesPerKB(void);
+extern uint32_t CRC_CalcWordCRC(uint32_t crc, uint32_t data);
+extern void CRC_StreamStart(CrcStream_TypeDef * stream);
+extern void CRC_StreamUpdate(CrcStream_TypeDef * stream, uint8_t * data, uint32_t length);
+extern uint32_t CRC_StreamFinish(CrcStream_TypeDef * stream);
+
+extern void LZ_DecodeStart(LzDecoder_TypeDef * lz, uint32_t length);
+extern uint32_t LZ_Decode(LzDecoder_TypeDef * lz, uint8_t * input, uint32_t input_length, uint8_t * output, uint32_t * output_length);
 
 extern void RTC_ReadBackupRegisters(void);
 extern void RTC_WriteBackupRegisters(void);
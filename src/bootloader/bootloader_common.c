@@ -25,33 +25,10 @@ extern FLASH_Status FLASH_WriteUserData(void) {
 	}
 	FLASH_Lock();
 
-	uint32_t address = USER_DATA_ADDRESS;
-	uint32_t length = sizeof(FlashUserData);
-	uint32_t index = 0;
-	uint8_t size = 0;
-
 	uint8_t data[sizeof(FlashUserData)];
 	memcpy(&data, &FlashUserData, sizeof(FlashUserData));
 
-	FLASH_Unlock();
-	while (length != 0) {
-		if (length >= sizeof(uint32_t)) size = sizeof(uint32_t);
-		else if (length >= sizeof(uint16_t)) size = sizeof(uint16_t);
-		else if (length >= sizeof(uint8_t)) size = sizeof(uint8_t);
-
-		if (size == sizeof(uint32_t)) status = FLASH_ProgramWord(address, *((uint32_t *)(&data[index])));
-		else if (size == sizeof(uint16_t)) status = FLASH_ProgramHalfWord(address, *((uint16_t *)(&data[index])));
-		else if (size == sizeof(uint8_t)) status = FLASH_ProgramByte(address, *((uint8_t *)(&data[index])));
-
-		if (status != FLASH_COMPLETE) break;
-
-		address += size;
-		length -= size;
-		index += size;
-	}
-	FLASH_Lock();
-
-	return status;
+	return FLASH_ProgramData(USER_DATA_ADDRESS, data, sizeof(FlashUserData));
 }
 
 extern void FLASH_ReadApplicationData(void) {
@@ -109,6 +86,334 @@ extern uint16_t FLASH_GetSector(uint32_t address) {
 	}
 }
 
+extern uint32_t FLASH_GetSectorAddress(uint16_t sector) {
+	assert_param(IS_FLASH_SECTOR(sector));
+
+	// 4 x 16 Kbytes, 1 x 64 Kbytes, then 128 Kbytes
+	if (sector < FLASH_Sector_4) {
+		return FLASH_SECTOR_0_ADDRESS + (sector >> 3) * FLASH_REGION_16K;
+	} else if (sector == FLASH_Sector_4) {
+		return FLASH_SECTOR_4_ADDRESS;
+	} else {
+		return FLASH_SECTOR_5_ADDRESS + ((sector - FLASH_Sector_5) >> 3) * FLASH_REGION_128K;
+	}
+}
+
+// first address past the end of flash on this part, from the flash size register
+extern uint32_t FLASH_GetEndAddress(void) {
+	uint32_t end = FLASH_REGION_START + *((uint16_t *)(FLASH_SIZE_ADDRESS)) * 1024;
+
+	// anything past sector 11 is the second bank of a 2 MB part, which FLASH_GetSector doesn't cover
+	if (end > FLASH_SECTOR_11_ADDRESS + FLASH_REGION_128K) end = FLASH_SECTOR_11_ADDRESS + FLASH_REGION_128K;
+
+	return end;
+}
+
+// programs an unaligned head and tail a byte at a time and everything in between as 32 bit words,
+// the parallelism (PSIZE) is only changed at the head/body/tail boundaries instead of for every write
+// note: no other flash operation can run between FLASH_ProgramStart and the last FLASH_ProgramContinue
+extern void FLASH_ProgramStart(FlashProgram_TypeDef * program, uint32_t address, uint8_t * data, uint32_t length) {
+	program->address = address;
+	program->data = data;
+	program->length = length;
+	program->index = 0;
+	program->psize = 0xFFFFFFFF;
+
+	// cycle counter for FLASH_GetProgramCyclesPerKB
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	FLASH_Unlock();
+	FLASH_WaitForLastOperation();
+	FLASH_ClearFlag(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+}
+
+// programs up to words words, returns FLASH_BUSY until the whole buffer has been programmed
+extern FLASH_Status FLASH_ProgramContinue(FlashProgram_TypeDef * program, uint32_t words) {
+	FLASH_Status status = FLASH_COMPLETE;
+	uint32_t start = DWT->CYCCNT;
+	uint32_t index = program->index;
+
+	while (words != 0 && program->index < program->length) {
+		uint32_t address = program->address + program->index;
+		uint32_t remaining = program->length - program->index;
+		uint32_t psize = ((address & 0x3) == 0 && remaining >= sizeof(uint32_t)) ? FLASH_PSIZE_WORD : FLASH_PSIZE_BYTE;
+
+		if (psize != program->psize) {
+			FLASH->CR &= ~(FLASH_CR_PSIZE);
+			FLASH->CR |= psize | FLASH_CR_PG;
+			program->psize = psize;
+		}
+
+		if (psize == FLASH_PSIZE_WORD) {
+			// stream aligned words straight through the controller, erased flash already reads 0xFFFFFFFF
+			while (words != 0 && remaining >= sizeof(uint32_t)) {
+				uint32_t data = *((uint32_t *)(&program->data[program->index]));
+				if (data != 0xFFFFFFFF) {
+					*(__IO uint32_t *)(address) = data;
+					while (FLASH->SR & FLASH_FLAG_BSY);
+				}
+
+				address += sizeof(uint32_t);
+				remaining -= sizeof(uint32_t);
+				program->index += sizeof(uint32_t);
+				words--;
+			}
+		} else {
+			if (program->data[program->index] != 0xFF) {
+				*(__IO uint8_t *)(address) = program->data[program->index];
+				while (FLASH->SR & FLASH_FLAG_BSY);
+			}
+
+			program->index += sizeof(uint8_t);
+			if ((program->index & 0x3) == 0) words--;
+		}
+
+		if (FLASH->SR & (FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR)) {
+			status = FLASH_ERROR_PROGRAM;
+			break;
+		}
+	}
+
+	FLASH_PROGRAM_CYCLES += DWT->CYCCNT - start;
+	FLASH_PROGRAM_BYTES += program->index - index;
+
+	if (status == FLASH_COMPLETE && program->index < program->length) return FLASH_BUSY;
+
+	FLASH->CR &= ~(FLASH_CR_PG);
+	FLASH_Lock();
+
+	return status;
+}
+
+extern FLASH_Status FLASH_ProgramData(uint32_t address, uint8_t * data, uint32_t length) {
+	FlashProgram_TypeDef program;
+	FLASH_ProgramStart(&program, address, data, length);
+	return FLASH_ProgramContinue(&program, 0xFFFFFFFF);
+}
+
+extern uint32_t FLASH_GetProgramCyclesPerKB(void) {
+	if (FLASH_PROGRAM_BYTES == 0) return 0;
+	return (uint32_t)(((uint64_t)FLASH_PROGRAM_CYCLES * 1024) / FLASH_PROGRAM_BYTES);
+}
+
+// crc of length bytes at address, fed to the crc unit a word at a time with the trailing
+// 1-3 bytes fed as a half word and/or byte (this matches the application image crc)
+extern uint32_t CRC_CalcDataCRC(uint32_t address, uint32_t length) {
+	uint8_t size = 0;
+
+	// cycle counter for CRC_GetCyclesPerKB
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	uint32_t start = DWT->CYCCNT;
+	CRC_BYTES = length;
+
+	CRC_ResetDR();
+
+	// the word aligned body is streamed in by dma, the tail is finished by the cpu below
+	if ((address & 0x3) == 0 && length >= sizeof(uint32_t)) {
+		uint32_t words = length / sizeof(uint32_t);
+		CRC_CalcBlockCRC_DMA(address, words);
+		address += words * sizeof(uint32_t);
+		length -= words * sizeof(uint32_t);
+	}
+
+	while (length != 0) {
+		if (length >= sizeof(uint32_t)) size = sizeof(uint32_t);
+		else if (length >= sizeof(uint16_t)) size = sizeof(uint16_t);
+		else if (length >= sizeof(uint8_t)) size = sizeof(uint8_t);
+
+		if (size == sizeof(uint32_t)) CRC_CalcCRC(*((uint32_t *)(address)));
+		else if (size == sizeof(uint16_t)) CRC_CalcCRC(*((uint16_t *)(address)));
+		else if (size == sizeof(uint8_t)) CRC_CalcCRC(*((uint8_t *)(address)));
+
+		address += size;
+		length -= size;
+	}
+
+	CRC_CYCLES = DWT->CYCCNT - start;
+
+	return CRC_GetCRC();
+}
+
+// feeds words words at address into the crc unit (without resetting it)
+extern void CRC_CalcBlockCRC_DMA(uint32_t address, uint32_t words) {
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA2, ENABLE);
+
+	// in memory to memory mode the peripheral port is the source and memory port 0 the destination
+	DMA_InitTypeDef DMA_InitStructure;
+	DMA_StructInit(&DMA_InitStructure);
+	DMA_InitStructure.DMA_Channel = CRC_DMA_CHANNEL;
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)(&CRC->DR);
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToMemory;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Enable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+	// direct mode isn't allowed for memory to memory transfers
+	DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
+	DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+	DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+	DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+
+	while (words > 0) {
+		uint32_t size = (words > DMA_TRANSFER_SIZE_MAX) ? DMA_TRANSFER_SIZE_MAX : words;
+
+		DMA_DeInit(CRC_DMA_STREAM);
+		DMA_InitStructure.DMA_PeripheralBaseAddr = address;
+		DMA_InitStructure.DMA_BufferSize = size;
+		DMA_Init(CRC_DMA_STREAM, &DMA_InitStructure);
+		DMA_ClearFlag(CRC_DMA_STREAM, CRC_DMA_FLAGS);
+		DMA_Cmd(CRC_DMA_STREAM, ENABLE);
+
+		// the stream disables itself once the transfer is complete
+		while (DMA_GetCmdStatus(CRC_DMA_STREAM) == ENABLE);
+
+		address += size * sizeof(uint32_t);
+		words -= size;
+	}
+}
+
+extern uint32_t CRC_GetCyclesPerKB(void) {
+	if (CRC_BYTES == 0) return 0;
+	return (uint32_t)(((uint64_t)CRC_CYCLES * 1024) / CRC_BYTES);
+}
+
+// software equivalent of writing data to CRC->DR with the unit holding crc
+extern uint32_t CRC_CalcWordCRC(uint32_t crc, uint32_t data) {
+	crc ^= data;
+	for (uint8_t i = 0; i < 8; i++) {
+		crc = (crc << 4) ^ CRC_NIBBLE_TABLE[crc >> 28];
+	}
+	return crc;
+}
+
+// incremental version of CRC_CalcDataCRC, so the crc of data can be built up a piece at a time
+// without holding the crc unit (which is reset by every CRC_CalcDataCRC)
+extern void CRC_StreamStart(CrcStream_TypeDef * stream) {
+	stream->crc = 0xFFFFFFFF;
+	stream->length = 0;
+	stream->word = 0;
+}
+
+extern void CRC_StreamUpdate(CrcStream_TypeDef * stream, uint8_t * data, uint32_t length) {
+	for (uint32_t i = 0; i < length; i++) {
+		stream->word |= (uint32_t)data[i] << ((stream->length & 0x3) * 8);
+		stream->length++;
+
+		if ((stream->length & 0x3) == 0) {
+			stream->crc = CRC_CalcWordCRC(stream->crc, stream->word);
+			stream->word = 0;
+		}
+	}
+}
+
+extern uint32_t CRC_StreamFinish(CrcStream_TypeDef * stream) {
+	uint32_t crc = stream->crc;
+
+	// trailing bytes go in as a half word and/or byte, same as CRC_CalcDataCRC
+	switch (stream->length & 0x3) {
+	case 3:
+		crc = CRC_CalcWordCRC(crc, stream->word & 0xFFFF);
+		crc = CRC_CalcWordCRC(crc, (stream->word >> 16) & 0xFF);
+		break;
+	case 2:
+		crc = CRC_CalcWordCRC(crc, stream->word & 0xFFFF);
+		break;
+	case 1:
+		crc = CRC_CalcWordCRC(crc, stream->word & 0xFF);
+		break;
+	}
+
+	return crc;
+}
+
+#if FEATURE_COMPRESSED
+extern void LZ_DecodeStart(LzDecoder_TypeDef * lz, uint32_t length) {
+	lz->state = (length != 0) ? LZ_STATE_TOKEN : LZ_STATE_DONE;
+	lz->token = 0;
+	lz->offset = 0;
+	lz->count = 0;
+	lz->position = 0;
+	lz->length = length;
+}
+
+// decodes input into output until one of them runs out, the stream can be split anywhere between calls
+// returns the number of input bytes used, output_length is the space in output going in and the bytes decoded coming out
+extern uint32_t LZ_Decode(LzDecoder_TypeDef * lz, uint8_t * input, uint32_t input_length, uint8_t * output, uint32_t * output_length) {
+	uint32_t in = 0;
+	uint32_t out = 0;
+	uint8_t data;
+
+	while (lz->state != LZ_STATE_DONE && lz->state != LZ_STATE_ERROR) {
+		if (lz->state == LZ_STATE_LITERALS || lz->state == LZ_STATE_MATCH) {
+			if (lz->count == 0) {
+				// the stream ends with a literal only sequence, once the length is reached
+				if (lz->position == lz->length) lz->state = LZ_STATE_DONE;
+				else lz->state = (lz->state == LZ_STATE_LITERALS) ? LZ_STATE_OFFSET_LOW : LZ_STATE_TOKEN;
+				continue;
+			}
+			if (out == *output_length) break;
+			if (lz->position == lz->length) {
+				lz->state = LZ_STATE_ERROR;
+				break;
+			}
+
+			if (lz->state == LZ_STATE_LITERALS) {
+				if (in == input_length) break;
+				data = input[in++];
+			} else {
+				data = lz->window[(lz->position - lz->offset) & (LZ_WINDOW_SIZE - 1)];
+			}
+
+			lz->window[lz->position & (LZ_WINDOW_SIZE - 1)] = data;
+			output[out++] = data;
+			lz->position++;
+			lz->count--;
+			continue;
+		}
+
+		if (in == input_length) break;
+		data = input[in++];
+
+		switch (lz->state) {
+		case LZ_STATE_TOKEN:
+			lz->token = data;
+			lz->count = data >> 4;
+			lz->state = (lz->count == 0xF) ? LZ_STATE_LITERAL_LENGTH : LZ_STATE_LITERALS;
+			break;
+		case LZ_STATE_LITERAL_LENGTH:
+			lz->count += data;
+			if (data != 0xFF) lz->state = LZ_STATE_LITERALS;
+			break;
+		case LZ_STATE_OFFSET_LOW:
+			lz->offset = data;
+			lz->state = LZ_STATE_OFFSET_HIGH;
+			break;
+		case LZ_STATE_OFFSET_HIGH:
+			lz->offset |= (uint16_t)(data << 8);
+			if (lz->offset == 0 || lz->offset > LZ_WINDOW_SIZE || lz->offset > lz->position) {
+				lz->state = LZ_STATE_ERROR;
+				break;
+			}
+			lz->count = (lz->token & 0xF) + LZ_MIN_MATCH;
+			lz->state = ((lz->token & 0xF) == 0xF) ? LZ_STATE_MATCH_LENGTH : LZ_STATE_MATCH;
+			break;
+		case LZ_STATE_MATCH_LENGTH:
+			lz->count += data;
+			if (data != 0xFF) lz->state = LZ_STATE_MATCH;
+			break;
+		}
+	}
+
+	*output_length = out;
+	return in;
+}
+#endif
+
 extern void RTC_ReadBackupRegisters(void) {
 	// read in words
 	uint32_t size = sizeof(RtcUserData) / 4;
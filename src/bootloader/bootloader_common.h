@@ -16,10 +16,13 @@
 
 #include "stm32f4xx_can.h"
 #include "stm32f4xx_flash.h"
+#include "stm32f4xx_crc.h"
+#include "stm32f4xx_dma.h"
+#include "stm32f4xx_rcc.h"
 
 // SJW [SYNC], BRP [PROP], BS1, BS2
 extern uint8_t CAN_BAUD_RATE_TIMING_MAP[8][4] = {
-	{ CAN_SJW_1tq, 0, 0, 0 }, // Custom
+	{ CAN_SJW_1tq, 0, 0, 0 }, // Custom, RtcUserData.can_settings
 	{ CAN_SJW_1tq, 3, CAN_BS1_11tq, CAN_BS2_2tq }, // 1000
 	{ CAN_SJW_1tq, 6, CAN_BS1_12tq, CAN_BS2_1tq }, // 500
 	{ CAN_SJW_1tq, 12, CAN_BS1_12tq, CAN_BS2_1tq }, // 250
@@ -34,12 +37,26 @@ extern char * RESET_FLAG_NAMES[5] = { "UNKNOWN", "POWER", "HARDWARE", "WATCHDOG"
 extern uint8_t RESET_FLAG = RESET_TYPE_UNKNOWN;
 extern char * RESET_FLAG_NAME = "UNKNOWN";
 
+// cycles spent in FLASH_ProgramContinue and the number of bytes it programmed
+extern uint32_t FLASH_PROGRAM_CYCLES = 0;
+extern uint32_t FLASH_PROGRAM_BYTES = 0;
+
+// cycles spent in the last CRC_CalcDataCRC and the number of bytes it covered
+extern uint32_t CRC_CYCLES = 0;
+extern uint32_t CRC_BYTES = 0;
+
 extern RtcUserData_TypeDef RtcUserData = { RTC_USER_DATA_MAGIC, RESET_TYPE_UNKNOWN, BOOT_FLAG_APPLICATION, CAN_BAUD_RATE_DEFAULT, 0, 0};
 extern FlashUserData_TypeDef FlashUserData = { FLASH_USER_DATA_MAGIC, 0, 0, 0, 0, 0, {0} };
 extern FlashApplicationData_TypeDef FlashApplicationData = { FLASH_APPLICATION_DATA_MAGIC, 0, 0, {0} };
 
 extern const uint8_t DEFAULT_FRAME_DATA[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
+// crc unit polynomial (0x04C11DB7) a nibble at a time, for CRC_StreamUpdate
+extern const uint32_t CRC_NIBBLE_TABLE[16] = {
+	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+	0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
+};
+
 extern void FLASH_ReadUserData(void);
 extern FLASH_Status FLASH_WriteUserData(void);
 
@@ -47,6 +64,24 @@ extern void FLASH_ReadApplicationData(void);
 
 extern FLASH_Status FLASH_EraseSectors(uint16_t sector, uint16_t end_sector, uint8_t VoltageRange);
 extern uint16_t FLASH_GetSector(uint32_t address);
+extern uint32_t FLASH_GetSectorAddress(uint16_t sector);
+extern uint32_t FLASH_GetEndAddress(void);
+
+extern void FLASH_ProgramStart(FlashProgram_TypeDef * program, uint32_t address, uint8_t * data, uint32_t length);
+extern FLASH_Status FLASH_ProgramContinue(FlashProgram_TypeDef * program, uint32_t words);
+extern FLASH_Status FLASH_ProgramData(uint32_t address, uint8_t * data, uint32_t length);
+extern uint32_t FLASH_GetProgramCyclesPerKB(void);
+
+extern uint32_t CRC_CalcDataCRC(uint32_t address, uint32_t length);
+extern void CRC_CalcBlockCRC_DMA(uint32_t address, uint32_t words);
+extern uint32_t CRC_GetCyclesPerKB(void);
+extern uint32_t CRC_CalcWordCRC(uint32_t crc, uint32_t data);
+extern void CRC_StreamStart(CrcStream_TypeDef * stream);
+extern void CRC_StreamUpdate(CrcStream_TypeDef * stream, uint8_t * data, uint32_t length);
+extern uint32_t CRC_StreamFinish(CrcStream_TypeDef * stream);
+
+extern void LZ_DecodeStart(LzDecoder_TypeDef * lz, uint32_t length);
+extern uint32_t LZ_Decode(LzDecoder_TypeDef * lz, uint8_t * input, uint32_t input_length, uint8_t * output, uint32_t * output_length);
 
 extern void RTC_ReadBackupRegisters(void);
 extern void RTC_WriteBackupRegisters(void);
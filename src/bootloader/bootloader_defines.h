@@ -12,6 +12,20 @@
 
 #include "stm32f4xx_flash.h"
 
+// optional features, each can be built out (-DFEATURE_x=0) to keep the bootloader within BOOTLOADER_SIZE
+#ifndef FEATURE_COMPRESSED
+#define FEATURE_COMPRESSED					1 // BOOTLOADER_WRITE_COMPRESSED and the lz4 decoder
+#endif
+#ifndef FEATURE_DELTA
+#define FEATURE_DELTA						1 // BOOTLOADER_WRITE_DELTA and BOOTLOADER_WRITE_KEEP
+#endif
+#ifndef FEATURE_MULTICAST
+#define FEATURE_MULTICAST					1 // BOOTLOADER_WRITE_MULTICAST and BOOTLOADER_WRITE_MULTICAST_STATUS (can)
+#endif
+#ifndef FEATURE_AUTOBAUD
+#define FEATURE_AUTOBAUD					1 // usart rate detection from the host's first ack
+#endif
+
 // flash layout
 #define STM32_BOOTLOADER_ADDRESS			0x1FFF0000
 
@@ -34,6 +48,13 @@
 // SCB->VTOR = APPLICATION_ENTRY_POINT_ADDRESS
 #define APPLICATION_VECTOR_TABLE_OFFSET		APPLICATION_HEADER_SIZE
 
+// the crc unit is fed by a memory to memory transfer, which only DMA2 can do
+#define CRC_DMA_CHANNEL				DMA_Channel_0
+#define CRC_DMA_STREAM				DMA2_Stream0
+#define CRC_DMA_FLAGS				(DMA_FLAG_TCIF0 | DMA_FLAG_HTIF0 | DMA_FLAG_TEIF0 | DMA_FLAG_DMEIF0 | DMA_FLAG_FEIF0)
+// maximum number of items in a single dma transfer (NDTR is 16 bits), words for the crc, bytes for the usart
+#define DMA_TRANSFER_SIZE_MAX		0xFFFF
+
 #define FLASH_REGION_16K			(1024 * 16)
 #define FLASH_REGION_64K			(1024 * 64)
 #define FLASH_REGION_128K			(1024 * 128)
@@ -60,6 +81,8 @@
 // ref lib: https://stm32f4-discovery.net/2015/01/library-49-one-time-programmable-otp-bytes-stm32f4xx/
 #define OTP_MEMORY_ADDRESS			0x1FFF7800 // 528 bytes (512 OTP bytes + 16 OTP lock bytes)
 #define OPTION_BYTES_MEMORY_ADDRESS	0x1FFFC000 // 16 bytes
+// size of the flash in Kbytes (16 bits) - RM0090, pg. 1713
+#define FLASH_SIZE_ADDRESS			0x1FFF7A22
 
 // CAN Extended ID Format & Definitions
 #define CAN_COMMAND_TYPE_MASK		0x1
@@ -84,6 +107,13 @@
 #define CAN_BROADCAST_BOARD_ID		0x0
 #define CAN_BROADCAST_NODE_ID		0x0
 
+// custom bit timing, packed as in the CAN_BTR register (sjw, bs1 and bs2 in time quanta, prescaler 1-1024)
+#define CAN_SETTINGS(sjw, prescaler, bs1, bs2)	((((uint32_t)(sjw) - 1) << 24) | (((uint32_t)(bs2) - 1) << 20) | (((uint32_t)(bs1) - 1) << 16) | ((uint32_t)(prescaler) - 1))
+#define CAN_SETTINGS_SJW(settings)				(((settings) >> 24) & 0x3) // as CAN_SJW_xtq
+#define CAN_SETTINGS_BS1(settings)				(((settings) >> 16) & 0xF) // as CAN_BS1_xtq
+#define CAN_SETTINGS_BS2(settings)				(((settings) >> 20) & 0x7) // as CAN_BS2_xtq
+#define CAN_SETTINGS_PRESCALER(settings)		(((settings) & 0x3FF) + 1)
+
 #define CAN_COMMAND_TYPE_REQUEST	0x0
 #define CAN_COMMAND_TYPE_RESPONSE	0x1
 
@@ -95,6 +125,10 @@
 #define BOOT_FLAG_PARALLAX_BOOTLOADER	0xBABE
 #define BOOT_FLAG_APPLICATION			0xBEEF
 
+// binds the crc and length of a verified application image, see RtcUserData.verified_token
+#define RTC_VERIFIED_MAGIC				0xFEEDBEEF
+#define RTC_VERIFIED_TOKEN(crc, length)	((crc) ^ (length) ^ RTC_VERIFIED_MAGIC)
+
 #define LED_POWER_PORT				GPIOC
 #define LED_POWER_RED				GPIO_Pin_13
 #define LED_POWER_GREEN				GPIO_Pin_15
@@ -114,6 +148,19 @@ typedef struct {
  uint32_t can_settings;
  uint8_t counter;
  uint64_t system_mode;
+ // application image verified since the last cold boot, erase or write (token is 0 when not verified)
+ uint32_t verified_crc;
+ uint32_t verified_length;
+ uint32_t verified_token;
+ // transfer journal, progress of the last write so it can be resumed after a link loss or reset (region is 0 when there is none)
+ uint8_t journal_region;
+ uint16_t journal_erased; // sectors erased by the write, they hold committed data and must not be erased again
+ uint16_t journal_segment; // number of the next segment
+ uint32_t journal_length;
+ uint32_t journal_offset; // bytes committed
+ uint32_t journal_crc; // CrcStream_TypeDef of the application body committed so far (length 0xFFFFFFFF if not valid)
+ uint32_t journal_crc_word;
+ uint32_t journal_crc_length;
 } __attribute__((aligned(8))) RtcUserData_TypeDef;
 
 typedef struct {
@@ -133,4 +180,47 @@ typedef struct {
 	uint8_t version[8];
 } __attribute__((aligned(4))) FlashApplicationData_TypeDef;
 
+// state of a FLASH_ProgramStart/FLASH_ProgramContinue operation
+typedef struct {
+	uint32_t address;
+	uint8_t * data;
+	uint32_t length;
+	uint32_t index;
+	uint32_t psize;
+} FlashProgram_TypeDef;
+
+// lz4 block format sequences (token, literals, 2 byte offset, match) decoded a byte at a time by LZ_Decode,
+// matches are copied out of a ring of the last LZ_WINDOW_SIZE bytes so the compressor must not use larger offsets
+// (the lz4 cli uses up to 64 KB and is rejected part way through, liblz4 has to be built with LZ4_DISTANCE_MAX <= LZ_WINDOW_SIZE)
+#define LZ_WINDOW_SIZE				4096 // must be a power of 2
+#define LZ_MIN_MATCH				4
+
+#define LZ_STATE_TOKEN				0x00
+#define LZ_STATE_LITERAL_LENGTH		0x01
+#define LZ_STATE_LITERALS			0x02
+#define LZ_STATE_OFFSET_LOW			0x03
+#define LZ_STATE_OFFSET_HIGH		0x04
+#define LZ_STATE_MATCH_LENGTH		0x05
+#define LZ_STATE_MATCH				0x06
+#define LZ_STATE_DONE				0x07
+#define LZ_STATE_ERROR				0x08
+
+typedef struct {
+	uint8_t state;
+	uint8_t token;
+	uint16_t offset;
+	uint32_t count; // literal or match bytes left in the current sequence
+	uint32_t position; // bytes decoded
+	uint32_t length; // decoded length, the stream ends there
+	uint8_t window[LZ_WINDOW_SIZE];
+} LzDecoder_TypeDef;
+
+// state of a CRC_StreamStart/CRC_StreamUpdate/CRC_StreamFinish calculation, bytes are packed into
+// little endian words before being fed in so the result matches CRC_CalcDataCRC over the same data
+typedef struct {
+	uint32_t crc;
+	uint32_t length;
+	uint32_t word;
+} CrcStream_TypeDef;
+
 #endif /* BOOTLOADER_DEFINES_H_ */
@@ -29,6 +29,8 @@ extern void __start(void)
 
 	if (RtcUserData.boot_flag == (uint16_t)BOOT_FLAG_STM32_BOOTLOADER) {
 		RtcUserData.boot_flag = BOOT_FLAG_PARALLAX_BOOTLOADER;
+		// the rom bootloader can rewrite the application, whatever was verified before can't be trusted after it
+		RtcUserData.verified_token = 0;
 		RTC_WriteBackupRegisters();
 		__asm(
 			"LDR     R0, =0x40023844 ; RCC_APB2ENR (0x40023800 | pg 266)\n\t"
@@ -81,6 +83,15 @@ int main(void)
 		RtcUserData.can_settings = 0;
 		RtcUserData.counter = 0;
 		RtcUserData.system_mode = 0;
+		RtcUserData.verified_crc = 0;
+		RtcUserData.verified_length = 0;
+		RtcUserData.verified_token = 0;
+		RtcUserData.journal_region = 0;
+	}
+
+	// the verified stamp only carries over warm (software/watchdog) resets, anything else verifies the image again
+	if (RESET_FLAG != RESET_TYPE_SOFTWARE && RESET_FLAG != RESET_TYPE_WATCHDOG) {
+		RtcUserData.verified_token = 0;
 	}
 
 	RtcUserData.reset_flag = RESET_FLAG;
@@ -100,6 +111,7 @@ int main(void)
 		FlashUserData.manufacture_date[1] = 0;
 		FlashUserData.manufacture_date[2] = 0;
 		FLASH_WriteUserData();
+		flash_user_data_written();
 		RtcUserData.boot_flag = BOOT_FLAG_PARALLAX_BOOTLOADER;
 	}
 
@@ -111,12 +123,15 @@ int main(void)
 
 	// if we are loading the application, verify it and then execute it
 	if (RtcUserData.boot_flag == (uint16_t)BOOT_FLAG_APPLICATION) {
-		if (verify_application()) {
+		if (verify_application_cached()) {
 			execute_application();
 		}
 	}
 
 	// application verification failed or bootflag is set for bootloader, initialize all peripherals used by the bootloader
+	// 1 ms time base for timeouts and pacing
+	SysTick_Config(SystemCoreClock / SYSTEM_TICK_RATE);
+
 	pincfg_usart3_init();
 	pincfg_can2_init();
 
@@ -128,22 +143,49 @@ int main(void)
 	can_tx.RTR = CAN_RTR_Data;
 	can_tx.IDE = CAN_ID_EXT;
 
+	// the host can open a usart session at any rate, the first ack byte is timed to find it
+	usart_autobaud_start();
+
 	// detect the interface we are using for the bootloader
 	while (1) {
 		// TODO v2 probe for usart bootloader flag
 
 		if (usart_receive(&usart_rx, false)) {
 			if (usart_rx == BOOTLOADER_ACK) {
+				usart_autobaud_stop();
 				usart_ack(BOOTLOADER_ACK);
+				NVIC_DisableIRQ(CAN2_TX_IRQn);
+				NVIC_DisableIRQ(CAN2_RX0_IRQn);
+				NVIC_DisableIRQ(CAN2_RX1_IRQn);
+				CAN_DeInit(CAN2);
+				usart_bootloader();
+			}
+		}
+
+		// an ack byte at another rate is garbage to the usart, switch to the rate it was sent at,
+		// the host's next ack has to arrive intact at that rate before can is given up (noise on the pin can match too)
+		if (usart_autobaud_rate != 0) {
+			uint32_t baud_rate = usart_autobaud_snap(usart_autobaud_rate);
+			usart_autobaud_stop();
+			if (usart_initialize_rate(baud_rate) && usart_speed_handshake()) {
+				NVIC_DisableIRQ(CAN2_TX_IRQn);
+				NVIC_DisableIRQ(CAN2_RX0_IRQn);
+				NVIC_DisableIRQ(CAN2_RX1_IRQn);
 				CAN_DeInit(CAN2);
 				usart_bootloader();
 			}
+			usart_initialize(USART_BAUD_RATE_DEFAULT);
+			usart_autobaud_start();
 		}
 
 		// probe for can bootloader flag
 		if (can_receive(&can_rx, false)) {
 			if (CAN_COMMAND == BOOTLOADER_ACK) {
+				usart_autobaud_stop();
 				can_ack(BOOTLOADER_ACK);
+				NVIC_DisableIRQ(USART3_IRQn);
+				DMA_DeInit(USART_RX_DMA_STREAM);
+				DMA_DeInit(USART_TX_DMA_STREAM);
 				USART_DeInit(USART3);
 				can_bootloader();
 			}
@@ -153,7 +195,60 @@ int main(void)
 }
 
 uint8_t usart_initialize(enum UsartBaudRate baud) {
+	return usart_initialize_rate(usart_baud_rate_of(baud));
+}
+
+uint32_t usart_baud_rate_of(enum UsartBaudRate baud) {
+	// USART_Custom (and anything unknown) has no fixed rate
+	if (baud == USART_115200_bps) return 115200;
+	else if (baud == USART_230400_bps) return 230400;
+	else if (baud == USART_460800_bps) return 460800;
+	else if (baud == USART_921600_bps) return 921600;
+	else if (baud == USART_2000000_bps) return 2000000;
+	else if (baud == USART_3000000_bps) return 3000000;
+	else return 0;
+}
+
+bool usart_rate_valid(uint32_t baud_rate) {
+	RCC_ClocksTypeDef RCC_Clocks;
+	RCC_GetClocksFreq(&RCC_Clocks);
+
+	if (baud_rate == 0) return false;
+
+	// the baud rate register divides pclk1 down to a whole number of cycles per bit (in either oversampling mode),
+	// at least 8 (oversampling by 8), and both ends only tolerate a few percent between them
+	uint32_t divider = (RCC_Clocks.PCLK1_Frequency + baud_rate / 2) / baud_rate;
+	if (divider < 8) return false;
+
+	uint32_t actual = RCC_Clocks.PCLK1_Frequency / divider;
+	uint32_t error = (actual > baud_rate) ? actual - baud_rate : baud_rate - actual;
+	return error <= baud_rate / USART_RATE_TOLERANCE;
+}
+
+bool usart_speed_handshake(void) {
+	// the host sends an ack at the new rate, which only gets through if both ends really are at the same rate
+	uint32_t start = system_ticks;
+	while (system_ticks - start < USART_SPEED_TIMEOUT) {
+		if (usart_receive(&usart_rx, false) && usart_rx == BOOTLOADER_ACK) {
+			usart_ack(BOOTLOADER_ACK);
+			return true;
+		}
+	}
+	return false;
+}
+
+uint8_t usart_initialize_rate(uint32_t baud_rate) {
+	if (!usart_rate_valid(baud_rate)) return 0;
+
+	// oversampling by 16 is more tolerant of noise, 8 reaches twice the rate (up to pclk1 / 8)
+	RCC_ClocksTypeDef RCC_Clocks;
+	RCC_GetClocksFreq(&RCC_Clocks);
+	bool over8 = (RCC_Clocks.PCLK1_Frequency / baud_rate) < 16;
+
 	// setup usart3
+	RCC_AHB1PeriphClockCmd(RCC_AHB1Periph_DMA1, ENABLE);
+	DMA_DeInit(USART_RX_DMA_STREAM);
+	DMA_DeInit(USART_TX_DMA_STREAM);
 	USART_DeInit(USART3);
 
 	// USART3 clock enable
@@ -164,12 +259,10 @@ uint8_t usart_initialize(enum UsartBaudRate baud) {
 
 	/* USART3 configuration */
 	/* X baud, window 8bits, one stop bit, no parity, no hw control, rx/tx enabled */
-	// TODO v2 implement support for USART baud rates other than 115200
-	if (baud == USART_115200_bps) USART_InitStructure.USART_BaudRate = 115200;
-	else if (baud == USART_230400_bps) USART_InitStructure.USART_BaudRate = 230400;
-	else if (baud == USART_460800_bps) USART_InitStructure.USART_BaudRate = 460800;
-	else if (baud == USART_921600_bps) USART_InitStructure.USART_BaudRate = 921600;
-	else return 0;
+	// USART_Init works the baud rate register out for the oversampling mode already set
+	USART_OverSampling8Cmd(USART3, over8 ? ENABLE : DISABLE);
+	USART_InitStructure.USART_BaudRate = baud_rate;
+	usart_baud_rate = baud_rate;
 
 	USART_InitStructure.USART_WordLength = USART_WordLength_8b;
 	USART_InitStructure.USART_StopBits = USART_StopBits_1;
@@ -179,11 +272,139 @@ uint8_t usart_initialize(enum UsartBaudRate baud) {
 	USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
 	USART_Init(USART3, &USART_InitStructure);
 
+	// flush the receive and transmit buffers, anything left over was for the old baud rate
+	usart_rx_buffer.in = 0;
+	usart_rx_buffer.out = 0;
+	usart_rx_frame = 0;
+	usart_tx_buffer_active = 0;
+	usart_tx_buffer_index = 0;
+
+	// receive runs continuously into the circular ring buffer so bytes arriving during flash operations are not overrun
+	DMA_InitTypeDef DMA_InitStructure;
+	DMA_StructInit(&DMA_InitStructure);
+	DMA_InitStructure.DMA_Channel = USART_DMA_CHANNEL;
+	DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)(&USART3->DR);
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)(usart_rx_buffer.buf);
+	DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+	DMA_InitStructure.DMA_BufferSize = USART_RX_BUFFER_SIZE;
+	DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+	DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+	DMA_Init(USART_RX_DMA_STREAM, &DMA_InitStructure);
+
+	// transmit is started per staging buffer/block in usart_send_dma
+	DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)(usart_tx_buffer[0]);
+	DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+	DMA_InitStructure.DMA_BufferSize = 1;
+	DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+	DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+	DMA_Init(USART_TX_DMA_STREAM, &DMA_InitStructure);
+
+	DMA_Cmd(USART_RX_DMA_STREAM, ENABLE);
+	USART_DMACmd(USART3, USART_DMAReq_Rx | USART_DMAReq_Tx, ENABLE);
+
+	// idle line detection marks the end of each frame sent by the host
+	NVIC_InitTypeDef NVIC_InitStructure;
+	NVIC_InitStructure.NVIC_IRQChannel = USART3_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	USART_ITConfig(USART3, USART_IT_IDLE, ENABLE);
+
 	USART_Cmd(USART3, ENABLE);
 
 	return 1;
 }
 
+#if FEATURE_AUTOBAUD
+void usart_autobaud_start(void) {
+	// edges are time stamped with the cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	usart_autobaud_count = 0;
+	usart_autobaud_rate = 0;
+
+	// exti sees the pin while it is in alternate function mode, so the usart keeps receiving at its own rate meanwhile
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_SYSCFG, ENABLE);
+	SYSCFG_EXTILineConfig(USART_RX_EXTI_PORT_SOURCE, USART_RX_EXTI_PIN_SOURCE);
+
+	EXTI_InitTypeDef EXTI_InitStructure;
+	EXTI_InitStructure.EXTI_Line = USART_RX_EXTI_LINE;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising_Falling;
+	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&EXTI_InitStructure);
+	EXTI_ClearITPendingBit(USART_RX_EXTI_LINE);
+
+	NVIC_InitTypeDef NVIC_InitStructure;
+	NVIC_InitStructure.NVIC_IRQChannel = USART_RX_EXTI_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+}
+
+void usart_autobaud_stop(void) {
+	NVIC_DisableIRQ(USART_RX_EXTI_IRQn);
+
+	EXTI_InitTypeDef EXTI_InitStructure;
+	EXTI_InitStructure.EXTI_Line = USART_RX_EXTI_LINE;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising_Falling;
+	EXTI_InitStructure.EXTI_LineCmd = DISABLE;
+	EXTI_Init(&EXTI_InitStructure);
+	EXTI_ClearITPendingBit(USART_RX_EXTI_LINE);
+}
+
+uint32_t usart_autobaud_snap(uint32_t baud_rate) {
+	// the measurement is off by a little interrupt latency, a host is almost always at a standard rate
+	for (uint8_t i = 0; i < sizeof(USART_AUTOBAUD_RATES) / sizeof(USART_AUTOBAUD_RATES[0]); i++) {
+		uint32_t rate = USART_AUTOBAUD_RATES[i];
+		if (baud_rate > rate - rate / USART_AUTOBAUD_SNAP && baud_rate < rate + rate / USART_AUTOBAUD_SNAP) return rate;
+	}
+	return baud_rate;
+}
+
+void EXTI15_10_IRQHandler(void) {
+	uint32_t now = DWT->CYCCNT;
+
+	// registers directly, the next edge can be as little as one bit time away
+	if ((EXTI->PR & USART_RX_EXTI_LINE) == 0) return;
+	EXTI->PR = USART_RX_EXTI_LINE;
+
+	usart_autobaud_edges[0] = usart_autobaud_edges[1];
+	usart_autobaud_edges[1] = usart_autobaud_edges[2];
+	usart_autobaud_edges[2] = usart_autobaud_edges[3];
+	usart_autobaud_edges[3] = now;
+	// the fourth edge completes an ack byte, the count saturates there
+	if (usart_autobaud_count < 4) usart_autobaud_count++;
+	if (usart_autobaud_count < 4) return;
+
+	// an ack byte (0x0F, lsb first) is the start bit, four 1 bits then four 0 bits before the stop bit,
+	// so its four edges are 1, 4 and 4 bit times apart
+	uint32_t start = usart_autobaud_edges[1] - usart_autobaud_edges[0];
+	uint32_t high = usart_autobaud_edges[2] - usart_autobaud_edges[1];
+	uint32_t low = usart_autobaud_edges[3] - usart_autobaud_edges[2];
+
+	if (high - low + high / 8 > high / 4) return; // |high - low| > high / 8
+	if (4 * start - high + high / 4 > high / 2) return; // |4 * start - high| > high / 4
+	if (start < USART_AUTOBAUD_BIT_CYCLES_MIN) return; // too fast to have timed every edge
+
+	// nine bit times from the start of the start bit to the start of the stop bit
+	uint32_t baud_rate = (9 * SystemCoreClock) / (usart_autobaud_edges[3] - usart_autobaud_edges[0]);
+	if (baud_rate < USART_AUTOBAUD_MIN) return;
+
+	usart_autobaud_rate = baud_rate;
+	NVIC_DisableIRQ(USART_RX_EXTI_IRQn);
+}
+#endif
+
 void usart_bootloader(void) {
 	while (1) {
         uint16_t usart_command;
@@ -206,18 +427,24 @@ void usart_bootloader(void) {
 		case BOOTLOADER_SPEED:
 		{
 			usart_receive(&usart_rx, true);// receive baud rate and initialize
-			if ( usart_rx <= USART_115200_bps && usart_rx >= USART_921600_bps)
+			uint32_t baud_rate = (usart_rx == USART_Custom) ? usart_receive_32() : usart_baud_rate_of(usart_rx);
+			if (usart_rate_valid(baud_rate))
 			{
 				usart_ack(BOOTLOADER_SPEED);
 			}
 			else
 			{
-				usart_ack(BOOTLOADER_SPEED);
+				usart_nack(BOOTLOADER_SPEED);
 				break;
 			}
 
-			delay(7000);
-			usart_initialize(usart_rx);
+			// switch as soon as the ack has left the shift register
+			usart_flush_wait();
+			uint32_t previous = usart_baud_rate;
+			usart_initialize_rate(baud_rate);
+
+			// the old rate is only abandoned once an ack has made it through at the new one
+			if (!usart_speed_handshake()) usart_initialize_rate(previous);
 			break;
 		}
 		case BOOTLOADER_ERASE:
@@ -286,129 +513,308 @@ void usart_bootloader(void) {
          	break;
          	  }
 
-         // send total length
+         // send total length, then the data straight out of flash
          usart_send_32(length);
-         	while (length > 0) {
-         		memcpy(&usart_tx, ((uint8_t *)(address)), 1);
-         		address++;
-         		usart_send(usart_tx);
-         		length--;
-         	}
+         usart_send_block(address, length);
                 usart_ack(BOOTLOADER_READ); // ack command after finished
 			break;
 		}
+		case BOOTLOADER_READ_RANGE:
+		{
+			// part of a region, e.g. to spot check an image without reading all of it
+			usart_receive(&usart_rx, true);
+			uint8_t flash_region = usart_rx & 0xFF;
+			uint32_t offset = usart_receive_32();
+			uint32_t length = usart_receive_32();
+			uint32_t address;
+
+			if (length == 0 || !flash_region_read_range(flash_region, offset, length, &address)) {
+				usart_nack(BOOTLOADER_READ_RANGE);
+				break;
+			}
+			usart_ack(BOOTLOADER_READ_RANGE);
+
+			usart_send_block(address, length);
+			usart_ack(BOOTLOADER_READ_RANGE);
+			break;
+		}
+		case BOOTLOADER_CHECKSUM:
+		{
+			// crc of a range worked out here, so verifying an image doesn't need it read back
+			uint32_t address = usart_receive_32();
+			uint32_t length = usart_receive_32();
+
+			if (length == 0 || !flash_address_range(address, length)) {
+				usart_nack(BOOTLOADER_CHECKSUM);
+				usart_send_32(0);
+				break;
+			}
+
+			uint32_t crc = CRC_CalcDataCRC(address, length);
+			usart_ack(BOOTLOADER_CHECKSUM);
+			usart_send_32(crc);
+			break;
+		}
+		case BOOTLOADER_SECTOR_DIGEST:
+		{
+			uint32_t crc[FLASH_SECTOR_DIGEST_MAX];
+			uint8_t count = flash_sector_digest(crc);
+
+			usart_ack(BOOTLOADER_SECTOR_DIGEST);
+			usart_send(APPLICATION_FLASH_SECTOR >> 3);
+			usart_send(count);
+			for (uint8_t i = 0; i < count; i++) {
+				usart_send_32(crc[i]);
+			}
+			break;
+		}
+#if FEATURE_DELTA
+		case BOOTLOADER_WRITE_DELTA:
+#endif
+#if FEATURE_COMPRESSED
+		case BOOTLOADER_WRITE_COMPRESSED:
+#endif
+		case BOOTLOADER_WRITE_RESUME:
 		case BOOTLOADER_WRITE:
 		{
+			uint8_t command = usart_command & 0xFF;
+			bool compressed = FEATURE_COMPRESSED && (command == BOOTLOADER_WRITE_COMPRESSED);
+			bool delta = FEATURE_DELTA && (command == BOOTLOADER_WRITE_DELTA);
 			usart_receive(&usart_rx, true);
 			uint16_t flash_region = usart_rx;
 			uint16_t current_command;
 
 			uint32_t length = usart_receive_32();
+			uint32_t base_crc = delta ? usart_receive_32() : 0;
 		    uint32_t address;
 
 		    if (flash_region == FLASH_REGION_USER_DATA || flash_region == FLASH_REGION_APPLICATION)
 		    {
 		    	if (flash_region == FLASH_REGION_USER_DATA && length <= USER_DATA_SIZE) {
 		    		address = USER_DATA_ADDRESS;
-		    		usart_ack(BOOTLOADER_WRITE);
 		    	} else if (flash_region == FLASH_REGION_APPLICATION && length <= APPLICATION_SIZE) {
 		    		address = APPLICATION_ADDRESS;
-		    		usart_ack(BOOTLOADER_WRITE);
 		    	} else {
-		    		usart_nack(BOOTLOADER_WRITE);
+		    		usart_nack(command);
 		    		break;
 		    			}
 		    }
 		    else {
-		    		usart_nack(BOOTLOADER_WRITE);
+		    		usart_nack(command);
 		    		break;
 		    	  }
 
+		    // a delta is made against one particular image, anything else installed can't be patched
+		    if (delta && (flash_region != FLASH_REGION_APPLICATION || !flash_write_delta_base(base_crc))) {
+		    	usart_nack(command);
+		    	break;
+		    }
+
+		    // a resumed write carries on after the last segment committed by an interrupted write of the same region and length
+		    if (command == BOOTLOADER_WRITE_RESUME) {
+		    	if (!journal_resume(flash_region, length)) {
+		    		usart_nack(command);
+		    		break;
+		    	}
+		    	usart_ack(command);
+		    	usart_send_32(RtcUserData.journal_offset);
+		    	usart_send_16(RtcUserData.journal_segment);
+		    } else {
+		    	usart_ack(command);
+		    }
+
 		    // receive , buffer and write data part
+		    // each segment is either 1024 write_segment command/byte pairs or a single write_packet
+		    // segments are committed to flash in the background while the next one is received
+		    // a compressed write counts offset in compressed bytes and length in decompressed bytes still to come
 		    int frames;
-		    uint32_t index;
-		    uint8_t size = 0;
+		    uint32_t offset = 0;
+		    bool timeout = false;
+		    bool aborted = false;
 		    FLASH_Status status = FLASH_COMPLETE;
+		    current_command = BOOTLOADER_WRITE_SEGMENT;
+
+		    flash_write_begin(address);
+		    if (command == BOOTLOADER_WRITE_RESUME) {
+		    	flash_write_resume();
+		    	offset = RtcUserData.journal_offset;
+		    	length -= offset;
+		    } else if (compressed) {
+		    	// the decoder history isn't journaled, so a compressed write can't be resumed
+		    	journal_clear();
+		    	flash_write_decompress_begin(length);
+		    } else if (delta) {
+		    	// once the first sector is replaced the installed image no longer matches the base, an interrupted delta is redone as a full write
+		    	journal_clear();
+		    } else {
+		    	journal_begin(flash_region, length);
+		    }
 
 		    while (length > 0)
 		    {
-		    			if (length >= BOOTLOADER_SEGMENT_SIZE) frames = 1024;
-		    			else frames = (uint8_t)length;
-
-		    			flash_buffer_index = 0;
-                        memset(&flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
-
-		    			// receive and buffer data
-		    			while (frames > 0)
-		    			    {
-		    				usart_receive(&current_command, true); // receive the write_segment command
-		    				usart_receive(&usart_rx, true);
-		    				if (current_command == BOOTLOADER_NACK) break;
-		    				if (current_command != BOOTLOADER_WRITE_SEGMENT) continue;
-		    				memcpy(&flash_buffer[flash_buffer_index], &usart_rx, 1);
-		    				flash_buffer_index += 1;
+		    	// a compressed segment fills over as many packets as it takes
+		    	if (!compressed) {
+		    		flash_buffer_index = 0;
+		    		memset(flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+		    	}
+
+		    	if (!usart_write_receive(&current_command)) {
+		    		timeout = true;
+		    		break;
+		    	}
+
+		    	if ((delta && current_command == BOOTLOADER_WRITE_KEEP) || (!compressed && current_command == BOOTLOADER_WRITE_SKIP)) {
+		    		uint8_t header[8];
+		    		if (!usart_write_receive_block(header, sizeof(header))) {
+		    			timeout = true;
+		    			break;
+		    		}
+		    		uint32_t range_offset = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+		    		uint32_t range_length = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) | ((uint32_t)header[6] << 8) | header[7];
+
+		    		if (range_offset != offset || range_length == 0 || range_length > length) {
+		    			usart_discard();
+		    			usart_nack(BOOTLOADER_WRITE_SEGMENT);
+		    			continue;
+		    		}
+
+		    		// a keep that isn't whole unerased sectors (or a skip whose erase failed) can't be honoured, the image would be missing data
+		    		if (current_command == BOOTLOADER_WRITE_KEEP) {
+		    			if (!flash_write_keep(range_length, range_length == length, usart_write_poll)) aborted = true;
+		    		} else {
+		    			if (!flash_write_skip(range_length, usart_write_poll)) aborted = true;
+		    		}
+		    		if (aborted) break;
+
+		    		length -= range_length;
+		    		offset += range_length;
+		    		usart_ack(BOOTLOADER_WRITE_SEGMENT);
+		    		continue;
+		    	}
+
+		    	if (current_command == BOOTLOADER_WRITE_PACKET) {
+		    		// header, raw payload and trailing crc of the payload
+		    		uint8_t header[6];
+		    		if (!usart_write_receive_block(header, sizeof(header))) {
+		    			timeout = true;
+		    			break;
+		    		}
+		    		uint32_t packet_offset = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+		    		uint16_t packet_length = (uint16_t)((header[4] << 8) | header[5]);
+
+		    		if (packet_offset != offset || packet_length == 0 || packet_length > BOOTLOADER_SEGMENT_SIZE || (!compressed && packet_length > length)) {
+		    			usart_discard();
+		    			usart_nack(BOOTLOADER_WRITE_SEGMENT);
+		    			continue;
+		    		}
+
+		    		uint8_t * packet = compressed ? lz_input : flash_buffer;
+		    		uint8_t crc[4];
+		    		if (!usart_write_receive_block(packet, packet_length) || !usart_write_receive_block(crc, sizeof(crc))) {
+		    			timeout = true;
+		    			break;
+		    		}
+
+		    		// a corrupted packet is not written, the host resends it at the same offset
+		    		if ((((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3]) != CRC_CalcDataCRC((uint32_t)(packet), packet_length)) {
+		    			usart_nack(BOOTLOADER_WRITE_SEGMENT);
+		    			continue;
+		    		}
+
+		    		if (compressed) {
+		    			// each segment the packet completes is queued by flash_write_decompress
+		    			if (!flash_write_decompress(lz_input, packet_length, usart_write_poll)) {
+		    				aborted = true;
+		    				break;
+		    			}
+		    			offset += packet_length;
+		    			length = flash_lz.length - flash_lz.position;
+		    		} else {
+		    			flash_buffer_index = packet_length;
+		    		}
+		    	} else if (compressed) {
+		    		// compressed data has to come in packets, a byte stream of unknown compressed length can't be framed
+		    		aborted = true;
+		    		break;
+		    	} else {
+		    		if (length >= BOOTLOADER_SEGMENT_SIZE) frames = BOOTLOADER_SEGMENT_SIZE;
+		    		else frames = length;
+
+		    		// receive and buffer data
+		    		while (frames > 0) {
+		    			if (!usart_write_receive(&usart_rx)) {
+		    				timeout = true;
+		    				break;
+		    			}
+		    			if (current_command == BOOTLOADER_NACK) break;
+		    			if (current_command == BOOTLOADER_WRITE_SEGMENT) {
+		    				flash_buffer[flash_buffer_index++] = (uint8_t)usart_rx;
 		    				frames--;
-		    				}
-
-		    				// write data
-		    				index = 0;
-		    				FLASH_Unlock();
-		    			while (index < flash_buffer_index)
-		    			 {
-		    				if (flash_buffer_index - index >= sizeof(uint32_t)) size = sizeof(uint32_t);
-		    				else if (flash_buffer_index - index >= sizeof(uint16_t)) size = sizeof(uint16_t);
-		    				else if (flash_buffer_index - index >= sizeof(uint8_t)) size = sizeof(uint8_t);
-
-		    				if (size == sizeof(uint32_t)) status = FLASH_ProgramWord(address, *((uint32_t *)(&flash_buffer[index])));
-		    				else if (size == sizeof(uint16_t)) status = FLASH_ProgramHalfWord(address, *((uint16_t *)(&flash_buffer[index])));
-		    				else if (size == sizeof(uint8_t)) status = FLASH_ProgramByte(address, *((uint8_t *)(&flash_buffer[index])));
-
-		    				if (status != FLASH_COMPLETE)
-		    				    {
-		    					break;
-		    					}
-		    				index += size;
-		    				address += size;
-		                  }
-		    				FLASH_Lock();
-
-		    				delay(10000);
-		    				// ack/nack 1k blocks
-		    				if (status == FLASH_COMPLETE) {
-		    					usart_ack(BOOTLOADER_WRITE_SEGMENT);
-		    					delay(7000);
-		    				} else if (status != FLASH_COMPLETE) {
-		    					usart_nack(BOOTLOADER_WRITE_SEGMENT);
-		    					break;
-		    				}
-		    				length -= index;
+		    			}
+		    			// receive the next write_segment command
+		    			if (frames > 0 && !usart_write_receive(&current_command)) {
+		    				timeout = true;
+		    				break;
+		    			}
+		    		}
+
+		    		if (timeout || current_command == BOOTLOADER_NACK) break;
+		    	}
+
+		    	if (!compressed) {
+		    		length -= flash_buffer_index;
+		    		offset += flash_buffer_index;
+
+		    		// hand the segment to the commit engine and wait for a free buffer for the next one
+		    		flash_write_queue();
+		    		while (!flash_write_ready()) usart_write_poll();
+		    	}
+
+		    	// ack/nack 1k blocks, the commit status of each block is reported separately by usart_write_poll
+		    	if (flash_commit_status == FLASH_COMPLETE) {
+		    		usart_ack(BOOTLOADER_WRITE_SEGMENT);
+		    	} else {
+		    		usart_nack(BOOTLOADER_WRITE_SEGMENT);
+		    		break;
+		    	}
 		    }
 
+		    // wait for the last segments to be committed
+		    while (!flash_write_idle()) usart_write_poll();
+		    status = flash_commit_status;
+		    flash_write_end();
+
+		    // the journal is only kept to resume a write that didn't finish
+		    if (length == 0 && status == FLASH_COMPLETE) journal_clear();
+
 		     // finished writing to flash, checks and send acks
-		    if (usart_command == BOOTLOADER_NACK) break;
+		    // the host went quiet part way through, whatever was received has been committed but the write is incomplete
+		    // (or the compressed data was corrupt or not sent in packets, or a range couldn't be kept or skipped)
+		    if (timeout || aborted) {
+		    	usart_nack(command);
+		    	break;
+		    }
+		    if (current_command == BOOTLOADER_NACK) break;
 
-            delay(500000);
 		    // ack/nack the entire operation
 		    if (status == FLASH_COMPLETE)
 		    {
-		    	usart_ack(BOOTLOADER_WRITE);
-		    	delay(10000);
+		    	usart_ack(command);
 		    }
 		    else if (status != FLASH_COMPLETE)
 		    {
-		    	usart_nack(BOOTLOADER_WRITE);
+		    	usart_nack(command);
 		    	break;
 		     }
 
-		    delay(500000);
 		    // verify the application
 		    if (flash_region == FLASH_REGION_APPLICATION)
 		    {
 		    	FLASH_ReadApplicationData();
-                if (verify_application()) {
-		    	  usart_ack(BOOTLOADER_WRITE);
+                if (verify_application_written()) {
+		    	  usart_ack(command);
 		    	} else {
-		   		  usart_nack(BOOTLOADER_WRITE);
+		   		  usart_nack(command);
 		    		   }
 		    }
            break;
@@ -431,7 +837,7 @@ void usart_bootloader(void) {
 		case BOOTLOADER_EXECUTE:
 		{
 			usart_ack(BOOTLOADER_EXECUTE);
-			delay(7000);
+			usart_flush_wait();
 
 			RtcUserData.boot_flag = BOOT_FLAG_APPLICATION;
 			RTC_WriteBackupRegisters();
@@ -463,6 +869,10 @@ void usart_bootloader(void) {
 					memcpy(&data, &FlashUserData.serial_number, sizeof(FlashUserData.serial_number));
 				} else if (key == KEY_BOARD_MANUFACTURE_DATE) {
 					memcpy(&data, &FlashUserData.manufacture_date, sizeof(FlashUserData.manufacture_date));
+				} else if (key == KEY_FLASH_PROGRAM_CYCLES) {
+					data = FLASH_GetProgramCyclesPerKB();
+				} else if (key == KEY_CRC_CYCLES) {
+					data = CRC_GetCyclesPerKB();
 				} else {
 					usart_nack(BOOTLOADER_READ_KEY);
 					break;
@@ -517,6 +927,7 @@ void usart_bootloader(void) {
 		case BOOTLOADER_SAVE_KEYS:
 		{
 			FLASH_Status status = FLASH_WriteUserData();
+			flash_user_data_written();
 			usart_ack(BOOTLOADER_SAVE_KEYS);
 
 			if(status == FLASH_COMPLETE)
@@ -545,14 +956,67 @@ void usart_bootloader(void) {
 				continue;
 			}
 			usart_ack(BOOTLOADER_RESET);
-			delay(7000);
+			usart_flush_wait();
 
 			RTC_WriteBackupRegisters();
 			NVIC_SystemReset();
 			break;
 		}
+		case BOOTLOADER_WRITE_QUERY:
+		{
+			// where an interrupted write can be resumed from, the crc lets the host check the committed data is its image
+			uint32_t address;
+			uint32_t crc = 0;
+			if (flash_region_range(RtcUserData.journal_region, 0, RtcUserData.journal_offset, &address)) {
+				crc = CRC_CalcDataCRC(address, RtcUserData.journal_offset);
+			}
+
+			usart_ack(BOOTLOADER_WRITE_QUERY);
+			usart_send(RtcUserData.journal_region);
+			usart_send_32(RtcUserData.journal_length);
+			usart_send_16(RtcUserData.journal_segment);
+			usart_send_32(RtcUserData.journal_offset);
+			usart_send_32(crc);
+			break;
+		}
+		case BOOTLOADER_REWRITE:
+		{
+			// rewrite part of a region in place, e.g. a segment whose commit crc didn't match what was sent
+			usart_receive(&usart_rx, true);
+			uint8_t flash_region = usart_rx & 0xFF;
+			uint32_t offset = usart_receive_32();
+			uint16_t length = usart_receive_16();
+			bool timeout = false;
+
+			if (length == 0 || length > BOOTLOADER_SEGMENT_SIZE) {
+				usart_discard();
+				usart_nack(BOOTLOADER_REWRITE);
+				usart_send_32(0);
+				break;
+			}
+
+			// no write is in progress, the first segment buffer is free
+			uint8_t * data = flash_segments[0].data;
+			uint8_t crc[4];
+			if (!usart_write_receive_block(data, length) || !usart_write_receive_block(crc, sizeof(crc))) timeout = true;
+
+			uint32_t address;
+			bool valid = flash_region_range(flash_region, offset, length, &address);
+			FLASH_Status status = FLASH_ERROR_OPERATION;
+
+			if (valid && !timeout && (((uint32_t)crc[0] << 24) | ((uint32_t)crc[1] << 16) | ((uint32_t)crc[2] << 8) | crc[3]) == CRC_CalcDataCRC((uint32_t)(data), length)) {
+				status = flash_rewrite(address, data, length);
+			}
+
+			if (status == FLASH_COMPLETE) usart_ack(BOOTLOADER_REWRITE);
+			else usart_nack(BOOTLOADER_REWRITE);
+			usart_send_32(valid ? CRC_CalcDataCRC(address, length) : 0);
+			break;
+		}
 		default:
 		{
+			// drop whatever else the host sent with the unknown command so it is not parsed as commands
+			usart_discard();
 			usart_nack(usart_command & 0xFF);
 			break;
 		}
@@ -560,16 +1024,67 @@ void usart_bootloader(void) {
 	}
 }
 
+void USART3_IRQHandler(void) {
+	uint16_t status = USART3->SR;
+
+	// reading SR followed by DR clears IDLE along with any overrun, noise or framing error, DR belongs to the rx dma stream
+	// so it is only read once the line is idle and the stream has taken the last byte (RXNE clear), until then IDLE stays
+	// pending and this runs again
+	if ((status & USART_FLAG_IDLE) && (status & USART_FLAG_RXNE) == 0) {
+		(void)USART3->DR;
+		usart_rx_frame = usart_rx_position();
+	}
+}
+
+void SysTick_Handler(void) {
+	system_ticks++;
+}
+
+uint32_t usart_rx_position(void) {
+	// NDTR counts down from USART_RX_BUFFER_SIZE and reloads in circular mode
+	return (USART_RX_BUFFER_SIZE - DMA_GetCurrDataCounter(USART_RX_DMA_STREAM)) & (USART_RX_BUFFER_SIZE - 1);
+}
+
 bool usart_receive(uint16_t * data, bool wait) {
+	struct usart_buf_st * p = &usart_rx_buffer;
+
+	// anything staged for transmit has to go out before we block waiting on the host
+	if (wait) usart_flush();
+
 	do {
-		if (USART_GetFlagStatus(USART3, USART_FLAG_RXNE) == SET) {
-			*data = USART_ReceiveData(USART3);
-			USART_ClearFlag(USART3, USART_FLAG_RXNE);
+		p->in = usart_rx_position();
+		if (p->in != p->out) {
+			*data = p->buf[p->out];
+			p->out = (p->out + 1) & (USART_RX_BUFFER_SIZE - 1);
 			return true;
 		}
 	} while (wait);
 	return false;
 }
+
+void usart_discard(void) {
+	uint32_t start = system_ticks;
+
+	// wait for the line to go idle and drop everything up to the end of that frame,
+	// a line that never goes idle (noise, a stuck host) is given up on and everything so far dropped
+	while (usart_rx_position() != usart_rx_frame) {
+		if (system_ticks - start >= BOOTLOADER_WRITE_TIMEOUT) {
+			usart_rx_buffer.out = usart_rx_position();
+			return;
+		}
+	}
+	usart_rx_buffer.out = usart_rx_frame;
+}
+
+uint16_t usart_receive_16(void) { // receives a 2 byte size value
+	uint16_t data;
+	usart_receive(&usart_rx, true);
+	data = (uint16_t)(usart_rx << 8); // msb
+	usart_receive(&usart_rx, true);
+	data = data | (uint16_t)(usart_rx); // lsb
+	return data;
+}
+
 uint32_t usart_receive_32(void){ // receives a 4 byte size value
 	uint32_t data;
 	usart_receive(&usart_rx, true);
@@ -607,21 +1122,107 @@ void usart_send_16(uint16_t data) {
 }
 
 void usart_send(uint8_t data) {
-	while (USART_GetFlagStatus(USART3, USART_FLAG_TXE) == RESET);
-	USART_SendData(USART3, data);
+	if (usart_tx_buffer_index >= USART_TX_BUFFER_SIZE) usart_flush();
+	usart_tx_buffer[usart_tx_buffer_active][usart_tx_buffer_index++] = data;
+}
+
+void usart_send_block(uint32_t address, uint32_t length) {
+	// keep ordering with anything already staged, then send the block directly from memory
+	usart_flush();
+	while (length > 0) {
+		uint16_t size = (length > DMA_TRANSFER_SIZE_MAX) ? DMA_TRANSFER_SIZE_MAX : (uint16_t)length;
+		usart_send_dma(address, size);
+		address += size;
+		length -= size;
+	}
+}
+
+void usart_send_dma(uint32_t address, uint16_t length) {
+	// only one transfer is in flight at a time, wait for the previous one to finish
+	while (DMA_GetCmdStatus(USART_TX_DMA_STREAM) == ENABLE);
+
+	DMA_ClearFlag(USART_TX_DMA_STREAM, USART_TX_DMA_FLAGS);
+	USART_ClearFlag(USART3, USART_FLAG_TC);
+	DMA_MemoryTargetConfig(USART_TX_DMA_STREAM, address, DMA_Memory_0);
+	DMA_SetCurrDataCounter(USART_TX_DMA_STREAM, length);
+	DMA_Cmd(USART_TX_DMA_STREAM, ENABLE);
+}
+
+void usart_flush(void) {
+	if (usart_tx_buffer_index == 0) return;
+
+	// send the active staging buffer and switch to the other one while it is in flight
+	usart_send_dma((uint32_t)(usart_tx_buffer[usart_tx_buffer_active]), usart_tx_buffer_index);
+	usart_tx_buffer_active ^= 1;
+	usart_tx_buffer_index = 0;
+}
+
+void usart_flush_wait(void) {
+	usart_flush();
+	while (DMA_GetCmdStatus(USART_TX_DMA_STREAM) == ENABLE);
+	// wait for the last byte to leave the shift register
+	while (USART_GetFlagStatus(USART3, USART_FLAG_TC) == RESET);
+}
+
+bool usart_write_receive(uint16_t * data) {
+	// keep committing buffered segments to flash while receiving, give up if the host stops sending
+	uint32_t start = system_ticks;
+
+	usart_flush();
+	while (!usart_receive(data, false)) {
+		usart_write_poll();
+		if (system_ticks - start >= BOOTLOADER_WRITE_TIMEOUT) return false;
+	}
+	return true;
+}
+
+bool usart_write_receive_block(uint8_t * data, uint16_t length) {
+	while (length > 0) {
+		if (!usart_write_receive(&usart_rx)) return false;
+		*data++ = (uint8_t)usart_rx;
+		length--;
+	}
+	return true;
+}
+
+void usart_write_poll(void) {
+	uint16_t segment;
+	FLASH_Status status;
+	uint32_t crc;
+
+	if (flash_commit_poll(&segment, &status, &crc)) {
+		usart_send(BOOTLOADER_WRITE_COMMIT);
+		usart_send(status == FLASH_COMPLETE ? BOOTLOADER_ACK : BOOTLOADER_NACK);
+		usart_send_16(segment);
+		usart_send_32(crc);
+		usart_flush();
+	}
 }
 
 void usart_ack(uint8_t command) {
+#if USART_RESPONSE_PACING > 0
+	usart_flush_wait();
+	delay(USART_RESPONSE_PACING);
+#endif
 	usart_send(command);
 	usart_send(BOOTLOADER_ACK);
+	usart_flush();
 }
 
 void usart_nack(uint8_t command) {
+#if USART_RESPONSE_PACING > 0
+	usart_flush_wait();
+	delay(USART_RESPONSE_PACING);
+#endif
 	usart_send(command);
 	usart_send(BOOTLOADER_NACK);
+	usart_flush();
 }
-void delay(int ticks){
-	for(int i = 0; i<ticks ; i++);
+
+void delay(uint32_t ticks) {
+	// ticks are ms of the SysTick time base
+	uint32_t start = system_ticks;
+	while (system_ticks - start < ticks);
 }
 
 uint8_t can_initialize(enum CanBaudRate baud) {
@@ -629,27 +1230,64 @@ uint8_t can_initialize(enum CanBaudRate baud) {
 	CAN_InitTypeDef CAN_InitStructure;
 	CAN_StructInit(&CAN_InitStructure);
 
-	CAN_InitStructure.CAN_TTCM = DISABLE;
+	CAN_InitStructure.CAN_TTCM = ENABLE; // receive time stamps keep frames from the two fifos in order
 	CAN_InitStructure.CAN_ABOM = DISABLE;
 	CAN_InitStructure.CAN_AWUM = DISABLE;
 	CAN_InitStructure.CAN_NART = DISABLE;
 	CAN_InitStructure.CAN_RFLM = DISABLE;
-	CAN_InitStructure.CAN_TXFP = DISABLE;
+	CAN_InitStructure.CAN_TXFP = ENABLE; // mailboxes go out in the order they were loaded, not by id
 	CAN_InitStructure.CAN_Mode = CAN_Mode_Normal;
 
 	CAN_DeInit(CAN2);
 
 	RCC_APB1PeriphClockCmd(RCC_APB1Periph_CAN1 | RCC_APB1Periph_CAN2, ENABLE);
 
-	CAN_InitStructure.CAN_SJW = CAN_BAUD_RATE_TIMING_MAP[baud][0];
-	CAN_InitStructure.CAN_Prescaler = CAN_BAUD_RATE_TIMING_MAP[baud][1];
-	CAN_InitStructure.CAN_BS1 = CAN_BAUD_RATE_TIMING_MAP[baud][2];
-	CAN_InitStructure.CAN_BS2 = CAN_BAUD_RATE_TIMING_MAP[baud][3];
+	if (baud == CAN_Custom) {
+		// prescalers past 255 don't fit the map, custom timing is kept in the rtc user data
+		uint32_t settings = RtcUserData.can_settings;
+		CAN_InitStructure.CAN_SJW = CAN_SETTINGS_SJW(settings);
+		CAN_InitStructure.CAN_Prescaler = CAN_SETTINGS_PRESCALER(settings);
+		CAN_InitStructure.CAN_BS1 = CAN_SETTINGS_BS1(settings);
+		CAN_InitStructure.CAN_BS2 = CAN_SETTINGS_BS2(settings);
+	} else if (baud <= CAN_10_kbps) {
+		CAN_InitStructure.CAN_SJW = CAN_BAUD_RATE_TIMING_MAP[baud][0];
+		CAN_InitStructure.CAN_Prescaler = CAN_BAUD_RATE_TIMING_MAP[baud][1];
+		CAN_InitStructure.CAN_BS1 = CAN_BAUD_RATE_TIMING_MAP[baud][2];
+		CAN_InitStructure.CAN_BS2 = CAN_BAUD_RATE_TIMING_MAP[baud][3];
+	} else {
+		return 0;
+	}
 
 	if (CAN_Init(CAN2, &CAN_InitStructure) != CAN_InitStatus_Success) {
 		return 0;
 	}
 
+	// time triggered mode would also put the transmit time stamp in the last two data bytes of each frame sent
+	for (uint8_t i = 0; i < 3; i++) {
+		CAN2->sTxMailBox[i].TDTR &= ~CAN_TDT0R_TGT;
+	}
+
+	// anything still queued was for the old baud rate
+	can_tx_queue.in = 0;
+	can_tx_queue.out = 0;
+	can_rx_queue.in = 0;
+	can_rx_queue.out = 0;
+
+	// refill the tx mailboxes as they empty, and empty the rx fifos as they fill (same priority, so they never nest)
+	NVIC_InitTypeDef NVIC_InitStructure;
+	NVIC_InitStructure.NVIC_IRQChannel = CAN2_TX_IRQn;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+	NVIC_Init(&NVIC_InitStructure);
+
+	NVIC_InitStructure.NVIC_IRQChannel = CAN2_RX0_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+	NVIC_InitStructure.NVIC_IRQChannel = CAN2_RX1_IRQn;
+	NVIC_Init(&NVIC_InitStructure);
+
+	CAN_ITConfig(CAN2, CAN_IT_TME | CAN_IT_FMP0 | CAN_IT_FMP1, ENABLE);
+
 	CAN_FilterInitTypeDef CAN_FilterInitStructure;
 	memset(&CAN_FilterInitStructure, 0, sizeof(CAN_FilterInitTypeDef));
 	CAN_FilterInitStructure.CAN_FilterMode = CAN_FilterMode_IdMask;
@@ -658,21 +1296,23 @@ uint8_t can_initialize(enum CanBaudRate baud) {
 	uint32_t filter_id, filter_mask;
 	uint16_t filter_fifo;
 
-	for (uint8_t i = 14; i < 17; i++) {
+	// 14-16 take the write_segment (data) frames into fifo1, 17-19 everything else (commands) into fifo0,
+	// a frame matching both is stored by the lower numbered filter
+	for (uint8_t i = 14; i < 20; i++) {
 		CAN_FilterInitStructure.CAN_FilterNumber = i;
-		if (i == 14) {
+		if (i == 14 || i == 17) {
 			// board/node id filter
 			filter_id = ((CAN_COMMAND_TYPE_REQUEST & CAN_COMMAND_TYPE_MASK) << 0) | ((BOARD_ID & CAN_ADDRESS_BOARD_MASK) << 9) | ((NODE_ID & CAN_ADDRESS_NODE_MASK) << 13) | ((CAN_BROADCAST_FLAG_NONE & CAN_BROADCAST_FLAG_MASK) << 25);
 			filter_mask = (CAN_COMMAND_TYPE_MASK << 0) | (CAN_ADDRESS_MASK << 9) | (CAN_ADDRESS_MASK << 13) | (CAN_BROADCAST_FLAG_MASK << 25);
 			filter_fifo = CAN_Filter_FIFO0;
 			CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
-		} else if (i == 15) {
+		} else if (i == 15 || i == 18) {
 			// board broadcast filter
 			filter_id = ((CAN_COMMAND_TYPE_REQUEST & CAN_COMMAND_TYPE_MASK) << 0) | ((BOARD_ID & CAN_ADDRESS_BOARD_MASK) << 9) | ((CAN_BROADCAST_FLAG_BOARD & CAN_BROADCAST_FLAG_MASK) << 25);
 			filter_mask = (CAN_COMMAND_TYPE_MASK << 0) | (CAN_ADDRESS_MASK << 9) | (CAN_BROADCAST_FLAG_MASK << 25);
 			filter_fifo = CAN_Filter_FIFO0;
 			CAN_FilterInitStructure.CAN_FilterActivation = ENABLE;
-		} else if (i == 16) {
+		} else if (i == 16 || i == 19) {
 			// global broadcast filter
 			filter_id = ((CAN_COMMAND_TYPE_REQUEST & CAN_COMMAND_TYPE_MASK) << 0) | ((CAN_BROADCAST_FLAG_NODE & CAN_BROADCAST_FLAG_MASK) << 25);
 			filter_mask = (CAN_COMMAND_TYPE_MASK << 0) | (CAN_BROADCAST_FLAG_MASK << 25);
@@ -685,6 +1325,12 @@ uint8_t can_initialize(enum CanBaudRate baud) {
 			CAN_FilterInitStructure.CAN_FilterActivation = DISABLE;
 		}
 
+		if (i < 17) {
+			filter_id |= (BOOTLOADER_WRITE_SEGMENT & CAN_COMMAND_MASK) << 1;
+			filter_mask |= CAN_COMMAND_MASK << 1;
+			filter_fifo = CAN_Filter_FIFO1;
+		}
+
 		// filter ignores 3 lsb's
 		filter_id = filter_id << 3;
 		filter_mask = filter_mask << 3;
@@ -700,6 +1346,25 @@ uint8_t can_initialize(enum CanBaudRate baud) {
 	return 1;
 }
 
+bool can_timing_valid(uint16_t prescaler, uint8_t bs1, uint8_t bs2, uint8_t sjw) {
+	RCC_ClocksTypeDef RCC_Clocks;
+	RCC_GetClocksFreq(&RCC_Clocks);
+
+	// register limits, the resynchronization jump can't be longer than either phase segment
+	if (prescaler < 1 || prescaler > 1024 || bs1 < 1 || bs1 > 16 || bs2 < 1 || bs2 > 8 || sjw < 1 || sjw > 4) return false;
+	if (sjw > bs1 || sjw > bs2) return false;
+
+	// the sync segment is always one quantum
+	uint32_t quanta = 1 + bs1 + bs2;
+	if (quanta < CAN_QUANTA_MIN || quanta > CAN_QUANTA_MAX) return false;
+
+	uint32_t sample_point = (100 * (1 + bs1)) / quanta;
+	if (sample_point < CAN_SAMPLE_POINT_MIN || sample_point > CAN_SAMPLE_POINT_MAX) return false;
+
+	// the bit rate comes off pclk1
+	return RCC_Clocks.PCLK1_Frequency / (prescaler * quanta) <= CAN_BIT_RATE_MAX;
+}
+
 void can_bootloader(void) {
 	while (1) {
 		can_receive(&can_rx, true);
@@ -723,15 +1388,38 @@ void can_bootloader(void) {
 		{
 			// verify parameter is within range and set, return ack/nack
 			uint8_t can_speed = can_rx.Data[0];
+			uint32_t settings = RtcUserData.can_settings;
 
-			if (can_speed >= CAN_1000_kbps && can_speed <= CAN_125_kbps) {
+			if (can_speed == CAN_Custom && can_rx.DLC >= 6) {
+				uint16_t prescaler = (uint16_t)(can_rx.Data[1] | (can_rx.Data[2] << 8));
+				if (can_timing_valid(prescaler, can_rx.Data[3], can_rx.Data[4], can_rx.Data[5])) {
+					settings = CAN_SETTINGS(can_rx.Data[5], prescaler, can_rx.Data[3], can_rx.Data[4]);
+					can_ack(BOOTLOADER_SPEED);
+				} else {
+					can_nack(BOOTLOADER_SPEED);
+					break;
+				}
+			} else if (can_speed >= CAN_1000_kbps && can_speed <= CAN_10_kbps) {
 				can_ack(BOOTLOADER_SPEED);
 			} else {
 				can_nack(BOOTLOADER_SPEED);
 				break;
 			}
 
-			can_initialize(can_speed);
+			// switch once the ack is on the bus
+			can_flush();
+
+			uint8_t previous_speed = RtcUserData.can_baud_rate;
+			uint32_t previous_settings = RtcUserData.can_settings;
+			RtcUserData.can_baud_rate = can_speed;
+			RtcUserData.can_settings = settings;
+			if (!can_initialize(can_speed)) {
+				// stay on the bus at the old rate
+				RtcUserData.can_baud_rate = previous_speed;
+				RtcUserData.can_settings = previous_settings;
+				can_initialize(previous_speed);
+			}
+			RTC_WriteBackupRegisters();
 
 			break;
 		}
@@ -802,94 +1490,330 @@ void can_bootloader(void) {
 
 			break;
 		}
+		case BOOTLOADER_READ_RANGE:
+		{
+			// part of a region, e.g. to spot check an image without reading all of it
+			uint8_t flash_region = can_rx.Data[0];
+			uint32_t offset = *((uint32_t *)&can_rx.Data[1]);
+			uint32_t length = (uint32_t)(can_rx.Data[5] | (can_rx.Data[6] << 8) | (can_rx.Data[7] << 16));
+			uint32_t address;
+
+			if (can_rx.DLC != 8 || length == 0 || !flash_region_read_range(flash_region, offset, length, &address)) {
+				can_nack(BOOTLOADER_READ_RANGE);
+				break;
+			}
+			can_ack(BOOTLOADER_READ_RANGE);
+
+			// frames go out through the tx queue as the mailboxes free up
+			uint8_t dlc;
+			while (length != 0) {
+				dlc = (length > 8) ? 8 : (uint8_t)length;
+				memcpy(&can_tx.Data, ((uint8_t *)(address)), dlc);
+				address += dlc;
+				can_send(&can_tx, BOOTLOADER_READ_SEGMENT, dlc);
+				length -= dlc;
+			}
+
+			can_ack(BOOTLOADER_READ_RANGE);
+			break;
+		}
+		case BOOTLOADER_CHECKSUM:
+		{
+			// crc of a range worked out here, so verifying an image doesn't need it read back
+			// Data sits at an odd offset in CanRxMsg, the fields are copied out rather than read in place
+			uint32_t address;
+			uint32_t length;
+			memcpy(&address, &can_rx.Data[0], sizeof(address));
+			memcpy(&length, &can_rx.Data[4], sizeof(length));
+			bool valid = (can_rx.DLC == 8 && length != 0 && flash_address_range(address, length));
+
+			uint32_t crc = valid ? CRC_CalcDataCRC(address, length) : 0;
+			can_tx.Data[0] = valid ? BOOTLOADER_ACK : BOOTLOADER_NACK;
+			memcpy(&can_tx.Data[1], &crc, sizeof(crc));
+			can_send(&can_tx, BOOTLOADER_CHECKSUM, 5);
+			break;
+		}
+		case BOOTLOADER_SECTOR_DIGEST:
+		{
+			uint32_t crc[FLASH_SECTOR_DIGEST_MAX];
+			uint8_t count = flash_sector_digest(crc);
+
+			can_tx.Data[0] = BOOTLOADER_ACK;
+			can_tx.Data[1] = APPLICATION_FLASH_SECTOR >> 3;
+			can_tx.Data[2] = count;
+			can_send(&can_tx, BOOTLOADER_SECTOR_DIGEST, 3);
+
+			// two crcs per frame, the last frame is short if the count is odd
+			for (uint8_t i = 0; i < count; i += 2) {
+				uint8_t dlc = (count - i > 1) ? 8 : 4;
+				memcpy(&can_tx.Data[0], &crc[i], dlc);
+				can_send(&can_tx, BOOTLOADER_SECTOR_DIGEST, dlc);
+			}
+			break;
+		}
+#if FEATURE_DELTA
+		case BOOTLOADER_WRITE_DELTA:
+#endif
+#if FEATURE_COMPRESSED
+		case BOOTLOADER_WRITE_COMPRESSED:
+#endif
+		case BOOTLOADER_WRITE_RESUME:
 		case BOOTLOADER_WRITE:
 		{
+			uint8_t command = CAN_COMMAND;
+			bool compressed = FEATURE_COMPRESSED && (command == BOOTLOADER_WRITE_COMPRESSED);
+			bool delta = FEATURE_DELTA && (command == BOOTLOADER_WRITE_DELTA);
 			uint8_t flash_region = can_rx.Data[0];
 			uint32_t length = *((uint32_t *)&can_rx.Data[1]);
+			bool windowed = (can_rx.DLC > 5 && can_rx.Data[5] == WRITE_MODE_WINDOWED);
+			uint32_t base_crc = 0;
 			uint32_t address;
 
+			// the base crc leaves no room in the frame for the region or mode, a delta is always a windowed application write
+			if (delta) {
+				flash_region = FLASH_REGION_APPLICATION;
+				memcpy(&length, &can_rx.Data[0], sizeof(length));
+				memcpy(&base_crc, &can_rx.Data[4], sizeof(base_crc));
+				windowed = true;
+				if (can_rx.DLC != 8 || !flash_write_delta_base(base_crc)) {
+					can_nack(command);
+					break;
+				}
+			}
+
 			// check and verify parameters
 			if (flash_region == FLASH_REGION_USER_DATA || flash_region == FLASH_REGION_APPLICATION) {
 				if (flash_region == FLASH_REGION_USER_DATA && length < USER_DATA_SIZE) {
 					address = USER_DATA_ADDRESS;
-					can_ack(BOOTLOADER_WRITE);
 				} else if (flash_region == FLASH_REGION_APPLICATION && length < APPLICATION_SIZE) {
 					address = APPLICATION_ADDRESS;
-					can_ack(BOOTLOADER_WRITE);
 				} else {
-					can_nack(BOOTLOADER_WRITE);
+					can_nack(command);
 					break;
 				}
 			} else {
-				can_nack(BOOTLOADER_WRITE);
+				can_nack(command);
+				break;
+			}
+
+			// a resumed write carries on after the last segment committed by an interrupted write of the same region and length
+			if (command == BOOTLOADER_WRITE_RESUME && !journal_resume(flash_region, length)) {
+				can_nack(command);
+				break;
+			}
+
+			// compressed data needs the windowed packet headers to know how much of it each segment carries
+			if (compressed && !windowed) {
+				can_nack(command);
 				break;
 			}
 
+			// a windowed write also tells the host how many segments it may send ahead of the last ack
+			can_tx.Data[0] = BOOTLOADER_ACK;
+			can_tx.Data[1] = CAN_WRITE_WINDOW;
+			if (command == BOOTLOADER_WRITE_RESUME) {
+				memcpy(&can_tx.Data[2], &RtcUserData.journal_offset, sizeof(uint32_t));
+				memcpy(&can_tx.Data[6], &RtcUserData.journal_segment, sizeof(uint16_t));
+				can_send(&can_tx, command, 8);
+			} else {
+				can_send(&can_tx, command, windowed ? 2 : 1);
+			}
+
 			// receive, buffer, and write data
+			// segments are committed to flash in the background while the next one is received
 			uint8_t frames;
-			uint32_t index;
-			uint8_t size = 0;
+			uint16_t sequence = 0; // next segment expected in a windowed write
+			bool resync = false; // the host has been asked to go back to sequence
+			uint32_t idle = 0; // ms a windowed write has gone without a frame
+			bool timeout = false;
+			bool aborted = false;
 			FLASH_Status status = FLASH_COMPLETE;
-			while (length > 0) {
-				if (length >= BOOTLOADER_SEGMENT_SIZE) frames = 128;
-				else frames = (uint8_t)ceil(length/8.0f);
 
-				flash_buffer_index = 0;
+			flash_write_begin(address);
+			if (command == BOOTLOADER_WRITE_RESUME) {
+				flash_write_resume();
+				length -= RtcUserData.journal_offset;
+				sequence = flash_segment_number;
+			} else if (compressed) {
+				// the decoder history isn't journaled, so a compressed write can't be resumed
+				journal_clear();
+				flash_write_decompress_begin(length);
+			} else if (delta) {
+				// once the first sector is replaced the installed image no longer matches the base, an interrupted delta is redone as a full write
+				journal_clear();
+			} else {
+				journal_begin(flash_region, length);
+			}
+
+			while (length > 0) {
+				// a compressed segment fills over as many packets as it takes
+				if (!compressed) {
+					flash_buffer_index = 0;
 
-				memset(&flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+					memset(flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+				}
 
-				// receive and buffer data
-				while (frames > 0) {
-					can_receive(&can_rx, true);
+				if (windowed) {
+					// each segment is a write_packet header (2 byte sequence number, 2 byte length) followed by its write_segment frames
+					if (!can_write_receive(&can_rx, BOOTLOADER_WRITE_IDLE_TIMEOUT)) {
+						idle += BOOTLOADER_WRITE_IDLE_TIMEOUT;
+						if (idle >= BOOTLOADER_WRITE_TIMEOUT) {
+							timeout = true;
+							break;
+						}
+
+						// the end of the window may have been lost with the host now waiting on its acks, go back to sequence
+						// (again every idle period, in case the nack itself was lost)
+						can_window_ack(BOOTLOADER_NACK, sequence);
+						resync = true;
+						continue;
+					}
+					idle = 0;
 					if (CAN_COMMAND == BOOTLOADER_NACK) break;
-					if (CAN_COMMAND != BOOTLOADER_WRITE_SEGMENT) continue;
-					memcpy(&flash_buffer[flash_buffer_index], &can_rx.Data, can_rx.DLC);
-					flash_buffer_index += can_rx.DLC;
-					frames--;
-				}
 
-				if (CAN_COMMAND == BOOTLOADER_NACK) break;
+					if ((delta && CAN_COMMAND == BOOTLOADER_WRITE_KEEP) || (!compressed && CAN_COMMAND == BOOTLOADER_WRITE_SKIP)) {
+						uint16_t range_sequence = (uint16_t)(can_rx.Data[0] | (can_rx.Data[1] << 8));
+						uint32_t range_length;
+						memcpy(&range_length, &can_rx.Data[2], sizeof(range_length));
+
+						if (range_sequence != sequence || range_length == 0 || range_length > length) {
+							if (!resync) can_window_ack(BOOTLOADER_NACK, sequence);
+							resync = true;
+							continue;
+						}
+
+						// waits for the queued segments to be committed, frames the host sends meanwhile may be dropped and resent
+						if (CAN_COMMAND == BOOTLOADER_WRITE_KEEP) {
+							if (!flash_write_keep(range_length, range_length == length, can_write_poll)) aborted = true;
+						} else {
+							if (!flash_write_skip(range_length, can_write_poll)) aborted = true;
+						}
+						if (aborted) break;
+
+						length -= range_length;
+						resync = false;
+						sequence++;
+						can_window_ack(BOOTLOADER_ACK, sequence - 1);
+						continue;
+					}
 
-				can_ack(BOOTLOADER_WRITE_SEGMENT);
+					if (CAN_COMMAND != BOOTLOADER_WRITE_PACKET) continue; // rest of a segment that is being dropped
 
-				// write data
-				index = 0;
-				FLASH_Unlock();
-				while (index < flash_buffer_index) {
-					if (flash_buffer_index - index >= sizeof(uint32_t)) size = sizeof(uint32_t);
-					else if (flash_buffer_index - index >= sizeof(uint16_t)) size = sizeof(uint16_t);
-					else if (flash_buffer_index - index >= sizeof(uint8_t)) size = sizeof(uint8_t);
+					uint16_t packet_sequence = (uint16_t)(can_rx.Data[0] | (can_rx.Data[1] << 8));
+					uint16_t packet_length = (uint16_t)(can_rx.Data[2] | (can_rx.Data[3] << 8));
+					bool packet_crc = (can_rx.DLC == 8);
+					uint32_t crc;
+					memcpy(&crc, &can_rx.Data[4], sizeof(crc));
 
-					if (size == sizeof(uint32_t)) status = FLASH_ProgramWord(address, *((uint32_t *)(&flash_buffer[index])));
-					else if (size == sizeof(uint16_t)) status = FLASH_ProgramHalfWord(address, *((uint16_t *)(&flash_buffer[index])));
-					else if (size == sizeof(uint8_t)) status = FLASH_ProgramByte(address, *((uint8_t *)(&flash_buffer[index])));
+					if (packet_sequence != sequence || packet_length == 0 || packet_length > BOOTLOADER_SEGMENT_SIZE || (!compressed && packet_length > length)) {
+						// a segment went missing, everything after it is dropped until the host goes back to it, ask only once
+						if (!resync) can_window_ack(BOOTLOADER_NACK, sequence);
+						resync = true;
+						continue;
+					}
 
-					if (status != FLASH_COMPLETE) {
-						break;
+					uint8_t * packet = compressed ? lz_input : flash_buffer;
+					uint16_t received = 0;
+					bool quiet = false;
+					while (received < packet_length) {
+						// the trailing frames of a segment may have been lost, don't wait out the whole write timeout for them
+						if (!can_write_receive(&can_rx, BOOTLOADER_WRITE_IDLE_TIMEOUT)) {
+							quiet = true;
+							break;
+						}
+						if (CAN_COMMAND != BOOTLOADER_WRITE_SEGMENT) break;
+						uint8_t dlc = can_rx.DLC;
+						if (dlc > packet_length - received) dlc = (uint8_t)(packet_length - received);
+						memcpy(&packet[received], &can_rx.Data, dlc);
+						received += dlc;
 					}
-					index += size;
-					address += size;
+
+					if (!quiet && CAN_COMMAND == BOOTLOADER_NACK) break;
+					if (quiet) idle = BOOTLOADER_WRITE_IDLE_TIMEOUT;
+
+					if (received < packet_length || (packet_crc && crc != CRC_CalcDataCRC((uint32_t)(packet), received))) {
+						// frames were dropped (e.g. fifo overrun during an erase), lost or corrupted, have the host resend from this segment
+						can_window_ack(BOOTLOADER_NACK, sequence);
+						resync = true;
+						continue;
+					}
+
+					resync = false;
+					sequence++;
+
+					if (compressed) {
+						// each segment the packet completes is queued by flash_write_decompress
+						if (!flash_write_decompress(lz_input, received, can_write_poll)) {
+							aborted = true;
+							break;
+						}
+						length = flash_lz.length - flash_lz.position;
+					} else {
+						flash_buffer_index = received;
+					}
+				} else {
+					if (length >= BOOTLOADER_SEGMENT_SIZE) frames = 128;
+					else frames = (uint8_t)ceil(length/8.0f);
+
+					// receive and buffer data
+					while (frames > 0) {
+						if (!can_write_receive(&can_rx, BOOTLOADER_WRITE_TIMEOUT)) {
+							timeout = true;
+							break;
+						}
+						if (CAN_COMMAND == BOOTLOADER_NACK) break;
+						if (CAN_COMMAND != BOOTLOADER_WRITE_SEGMENT) continue;
+						memcpy(&flash_buffer[flash_buffer_index], &can_rx.Data, can_rx.DLC);
+						flash_buffer_index += can_rx.DLC;
+						frames--;
+					}
+
+					if (timeout || CAN_COMMAND == BOOTLOADER_NACK) break;
+
+					if (flash_buffer_index > length) flash_buffer_index = length;
 				}
-				FLASH_Lock();
 
-				// ack/nack 1k blocks
-				if (status == FLASH_COMPLETE) {
-					can_ack(BOOTLOADER_WRITE_SEGMENT);
-				} else if (status != FLASH_COMPLETE) {
-					can_nack(BOOTLOADER_WRITE_SEGMENT);
-					break;
+				if (!compressed) {
+					length -= flash_buffer_index;
+
+					// hand the segment to the commit engine and wait for a free buffer for the next one
+					flash_write_queue();
+					while (!flash_write_ready()) can_write_poll();
 				}
 
-				length -= index;
+				// ack/nack 1k blocks, the commit status of each block is reported separately by can_write_poll
+				// a windowed write is acked cumulatively, every segment up to and including sequence - 1 has been received
+				if (flash_commit_status == FLASH_COMPLETE) {
+					if (windowed) can_window_ack(BOOTLOADER_ACK, sequence - 1);
+					else can_ack(BOOTLOADER_WRITE_SEGMENT);
+				} else {
+					// a windowed nack means resend, the failure is reported by the write nack below
+					if (!windowed) can_nack(BOOTLOADER_WRITE_SEGMENT);
+					break;
+				}
 			}
 
+			// wait for the last segments to be committed
+			while (!flash_write_idle()) can_write_poll();
+			status = flash_commit_status;
+			flash_write_end();
+
+			// the journal is only kept to resume a write that didn't finish
+			if (length == 0 && status == FLASH_COMPLETE) journal_clear();
+
+			// the host went quiet part way through, whatever was received has been committed but the write is incomplete
+			// (or the compressed data was corrupt, or a range couldn't be kept or skipped)
+			if (timeout || aborted) {
+				can_nack(command);
+				break;
+			}
 			if (CAN_COMMAND == BOOTLOADER_NACK) break;
 
 			// ack/nack the entire operation
 			if (status == FLASH_COMPLETE) {
-				can_ack(BOOTLOADER_WRITE);
+				can_ack(command);
 			} else if (status != FLASH_COMPLETE) {
-				can_nack(BOOTLOADER_WRITE);
+				can_nack(command);
 				break;
 			}
 
@@ -897,10 +1821,10 @@ void can_bootloader(void) {
 				// verify the application
 				FLASH_ReadApplicationData();
 
-				if (verify_application()) {
-					can_ack(BOOTLOADER_WRITE);
+				if (verify_application_written()) {
+					can_ack(command);
 				} else {
-					can_nack(BOOTLOADER_WRITE);
+					can_nack(command);
 				}
 			}
 
@@ -924,6 +1848,7 @@ void can_bootloader(void) {
 		{
 			// return ack, set boot flag, save and reset
 			can_ack(BOOTLOADER_EXECUTE);
+			can_flush();
 
 			RtcUserData.boot_flag = BOOT_FLAG_APPLICATION;
 			RTC_WriteBackupRegisters();
@@ -958,6 +1883,12 @@ void can_bootloader(void) {
 					memcpy(&can_tx.Data[2], &FlashUserData.serial_number, sizeof(FlashUserData.serial_number));
 				} else if (key == KEY_BOARD_MANUFACTURE_DATE) {
 					memcpy(&can_tx.Data[2], &FlashUserData.manufacture_date, sizeof(FlashUserData.manufacture_date));
+				} else if (key == KEY_FLASH_PROGRAM_CYCLES) {
+					uint32_t cycles = FLASH_GetProgramCyclesPerKB();
+					memcpy(&can_tx.Data[2], &cycles, sizeof(cycles));
+				} else if (key == KEY_CRC_CYCLES) {
+					uint32_t cycles = CRC_GetCyclesPerKB();
+					memcpy(&can_tx.Data[2], &cycles, sizeof(cycles));
 				} else {
 					can_nack(BOOTLOADER_READ_KEY);
 					break;
@@ -1008,6 +1939,7 @@ void can_bootloader(void) {
 			can_ack(BOOTLOADER_SAVE_KEYS);
 
 			FLASH_Status status = FLASH_WriteUserData();
+			flash_user_data_written();
 
 			if (status == FLASH_COMPLETE) can_ack(BOOTLOADER_SAVE_KEYS);
 			else if (status != FLASH_COMPLETE) can_nack(BOOTLOADER_SAVE_KEYS);
@@ -1028,20 +1960,201 @@ void can_bootloader(void) {
 			}
 
 			can_ack(BOOTLOADER_RESET);
+			can_flush();
 
 			RTC_WriteBackupRegisters();
 
 			NVIC_SystemReset();
 			break;
 		}
+		case BOOTLOADER_WRITE_QUERY:
+		{
+			// where an interrupted write can be resumed from, the crc lets the host check the committed data is its image
+			uint32_t address;
+			uint32_t crc = 0;
+			if (flash_region_range(RtcUserData.journal_region, 0, RtcUserData.journal_offset, &address)) {
+				crc = CRC_CalcDataCRC(address, RtcUserData.journal_offset);
+			}
+
+			// two frames, ack, region, length, segment number then offset, crc
+			can_tx.Data[0] = BOOTLOADER_ACK;
+			can_tx.Data[1] = RtcUserData.journal_region;
+			memcpy(&can_tx.Data[2], &RtcUserData.journal_length, sizeof(uint32_t));
+			memcpy(&can_tx.Data[6], &RtcUserData.journal_segment, sizeof(uint16_t));
+			can_send(&can_tx, BOOTLOADER_WRITE_QUERY, 8);
+			memcpy(&can_tx.Data[0], &RtcUserData.journal_offset, sizeof(uint32_t));
+			memcpy(&can_tx.Data[4], &crc, sizeof(uint32_t));
+			can_send(&can_tx, BOOTLOADER_WRITE_QUERY, 8);
+
+			break;
+		}
+#if FEATURE_MULTICAST
+		case BOOTLOADER_WRITE_MULTICAST:
+		{
+			// every node takes the same stream and stays quiet, the host asks each one for its missing segments at the end
+			// and resends only those, so the cost doesn't grow with the number of nodes
+			uint8_t flash_region = can_rx.Data[0];
+			uint32_t length = *((uint32_t *)&can_rx.Data[1]);
+			uint32_t address;
+
+			if (length == 0 || !flash_region_range(flash_region, 0, length, &address)) {
+				can_nack(BOOTLOADER_WRITE_MULTICAST);
+				break;
+			}
+
+			uint16_t segments = (uint16_t)((length + BOOTLOADER_SEGMENT_SIZE - 1) / BOOTLOADER_SEGMENT_SIZE);
+			uint16_t missing = segments;
+			uint16_t sequence = 0xFFFF; // segment being received, 0xFFFF while frames are being ignored
+			uint16_t packet_length = 0;
+			uint32_t packet_crc = 0;
+			FLASH_Status status;
+
+			// segments arrive in any order and any of them can be lost, so the journal can't describe what has been written
+			journal_clear();
+			flash_write_begin(address);
+
+			// erase everything up front, an erase part way through the stream would lose frames on every node
+			status = flash_erase(address, length);
+			if (status != FLASH_COMPLETE) {
+				flash_write_end();
+				can_nack(BOOTLOADER_WRITE_MULTICAST);
+				break;
+			}
+			can_ack(BOOTLOADER_WRITE_MULTICAST);
+
+			memset(flash_missing, 0, sizeof(flash_missing));
+			for (uint16_t i = 0; i < segments; i++) flash_missing[i >> 3] |= (1 << (i & 0x7));
+			can_write_quiet = true;
+			can_multicast_session = MULTICAST_SESSION_NONE;
+
+			while (1) {
+				// a host that has gone away leaves the write incomplete, a later status request reports it was dropped
+				if (!can_write_receive(&can_rx, BOOTLOADER_MULTICAST_TIMEOUT)) {
+					can_multicast_session = MULTICAST_SESSION_DROPPED;
+					break;
+				}
+
+				if (CAN_COMMAND == BOOTLOADER_WRITE_PACKET) {
+					uint16_t packet_sequence = (uint16_t)(can_rx.Data[0] | (can_rx.Data[1] << 8));
+					packet_length = (uint16_t)(can_rx.Data[2] | (can_rx.Data[3] << 8));
+					memcpy(&packet_crc, &can_rx.Data[4], sizeof(packet_crc));
+					sequence = 0xFFFF;
+
+					// segments this node already has are being resent for others, and only whole segments with a crc are accepted
+					if (can_rx.DLC != 8 || packet_sequence >= segments || (flash_missing[packet_sequence >> 3] & (1 << (packet_sequence & 0x7))) == 0) continue;
+					if (packet_length != ((packet_sequence == segments - 1) ? length - packet_sequence * BOOTLOADER_SEGMENT_SIZE : BOOTLOADER_SEGMENT_SIZE)) continue;
+
+					while (!flash_write_ready()) can_write_poll();
+					memset(flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+					flash_buffer_index = 0;
+					sequence = packet_sequence;
+				} else if (CAN_COMMAND == BOOTLOADER_WRITE_SEGMENT) {
+					if (sequence == 0xFFFF) continue;
+
+					uint8_t dlc = can_rx.DLC;
+					if (dlc > packet_length - flash_buffer_index) dlc = (uint8_t)(packet_length - flash_buffer_index);
+					memcpy(&flash_buffer[flash_buffer_index], &can_rx.Data, dlc);
+					flash_buffer_index += dlc;
+
+					if (flash_buffer_index < packet_length) continue;
+
+					// a corrupt segment stays missing and is picked up by the repair pass
+					if (packet_crc == CRC_CalcDataCRC((uint32_t)(flash_buffer), flash_buffer_index)) {
+						flash_write_address = flash_write_base + (uint32_t)sequence * BOOTLOADER_SEGMENT_SIZE;
+						flash_segment_number = sequence;
+						flash_write_queue();
+					}
+					sequence = 0xFFFF;
+				} else if (CAN_COMMAND == BOOTLOADER_WRITE_MULTICAST_STATUS) {
+					// report what has actually been committed
+					while (!flash_write_idle()) can_write_poll();
+					status = flash_commit_status;
+
+					missing = 0;
+					for (uint16_t i = 0; i < segments; i++) {
+						if (flash_missing[i >> 3] & (1 << (i & 0x7))) missing++;
+					}
+
+					if (status != FLASH_COMPLETE || missing != 0) {
+						can_multicast_status(segments, missing, (status == FLASH_COMPLETE) ? BOOTLOADER_ACK : BOOTLOADER_NACK);
+						if (status != FLASH_COMPLETE) break;
+						continue;
+					}
+
+					// complete, the stream crc doesn't cover out of order segments so the image is read back
+					FLASH_ReadApplicationData();
+					bool verified = (flash_region != FLASH_REGION_APPLICATION) || verify_application();
+					can_multicast_status(segments, 0, verified ? BOOTLOADER_ACK : BOOTLOADER_NACK);
+					break;
+				} else if (CAN_COMMAND == BOOTLOADER_NACK) {
+					// the host gave up on the write
+					break;
+				}
+			}
+
+			while (!flash_write_idle()) can_write_poll();
+			can_write_quiet = false;
+			flash_write_end();
+
+			break;
+		}
+		case BOOTLOADER_WRITE_MULTICAST_STATUS:
+		{
+			// not (or no longer) in a multicast write, a node that completed has already reported it,
+			// one that dropped the write says so, so the host doesn't take it for a node that is only missing segments
+			can_tx.Data[0] = BOOTLOADER_NACK;
+			can_tx.Data[1] = 0xFF;
+			can_tx.Data[2] = 0xFF;
+			can_tx.Data[3] = can_multicast_session;
+			can_send(&can_tx, BOOTLOADER_WRITE_MULTICAST_STATUS, 4);
+			break;
+		}
+#endif
+		case BOOTLOADER_REWRITE:
+		{
+			// rewrite part of a region in place, e.g. a segment whose commit crc didn't match what was sent
+			uint8_t flash_region = can_rx.Data[0];
+			uint32_t offset = *((uint32_t *)&can_rx.Data[1]);
+			uint16_t length = *((uint16_t *)&can_rx.Data[5]);
+			uint32_t address;
+			bool valid = (length != 0 && length <= BOOTLOADER_SEGMENT_SIZE) && flash_region_range(flash_region, offset, length, &address);
+			bool timeout = false;
+
+			// no write is in progress, the first segment buffer is free
+			uint8_t * data = flash_segments[0].data;
+			uint16_t index = 0;
+
+			while (valid && index < length) {
+				if (!can_write_receive(&can_rx, BOOTLOADER_WRITE_TIMEOUT)) {
+					timeout = true;
+					break;
+				}
+				if (CAN_COMMAND != BOOTLOADER_WRITE_SEGMENT) break;
+				uint8_t dlc = can_rx.DLC;
+				if (dlc > length - index) dlc = (uint8_t)(length - index);
+				memcpy(&data[index], &can_rx.Data, dlc);
+				index += dlc;
+			}
+
+			FLASH_Status status = FLASH_ERROR_OPERATION;
+			if (valid && !timeout && index == length) status = flash_rewrite(address, data, length);
+
+			uint32_t crc = valid ? CRC_CalcDataCRC(address, length) : 0;
+			can_tx.Data[0] = (status == FLASH_COMPLETE) ? BOOTLOADER_ACK : BOOTLOADER_NACK;
+			memcpy(&can_tx.Data[1], &crc, sizeof(crc));
+			can_send(&can_tx, BOOTLOADER_REWRITE, 5);
+
+			break;
+		}
 		}
 	}
 }
 
 bool can_receive(CanRxMsg * msg, bool wait) {
 	do {
-		if (CAN_GetFlagStatus(CAN2, CAN_FLAG_FMP0) == SET) {
-			CAN_Receive(CAN2, CAN_FIFO0, msg);
+		if (can_rx_queue.out != can_rx_queue.in) {
+			*msg = can_rx_queue.buf[can_rx_queue.out];
+			can_rx_queue.out = (can_rx_queue.out + 1) & (CAN_RX_QUEUE_SIZE - 1);
 
 			CAN_COMMAND_TYPE = (msg->ExtId >> 0) & CAN_COMMAND_TYPE_MASK;
 			CAN_COMMAND	= (msg->ExtId >> 1) & CAN_COMMAND_MASK;
@@ -1054,7 +2167,6 @@ bool can_receive(CanRxMsg * msg, bool wait) {
 			CAN_BROADCAST_FLAG = (msg->ExtId >> 25) & CAN_BROADCAST_FLAG_MASK;
 			CAN_PRIORITY = (msg->ExtId >> 27) & CAN_PRIORITY_MASK;
 
-			CAN_ClearFlag(CAN2, CAN_FLAG_FMP0);
 			return true;
 		}
 	} while (wait);
@@ -1073,8 +2185,158 @@ void can_send(CanTxMsg * msg, uint8_t command, uint8_t dlc) {
 	id |= (CAN_PRIORITY_VERY_HIGH & CAN_PRIORITY_MASK) << 27;
 	msg->ExtId = id;
 	msg->DLC = dlc;
-	uint8_t mailbox = CAN_Transmit(CAN2, msg);
-	while (CAN_TransmitStatus(CAN2, mailbox) != CAN_TxStatus_Ok);
+
+	// wait for room in the queue, if nothing has gone out for a while nobody is acknowledging frames on the bus
+	uint32_t start = system_ticks;
+	while (((can_tx_queue.in + 1) & (CAN_TX_QUEUE_SIZE - 1)) == can_tx_queue.out) {
+		if (system_ticks - start >= CAN_SEND_TIMEOUT) can_tx_abort();
+	}
+
+	can_tx_queue.buf[can_tx_queue.in] = *msg;
+	can_tx_queue.in = (can_tx_queue.in + 1) & (CAN_TX_QUEUE_SIZE - 1);
+
+	// the interrupt only fires when a mailbox empties, so if any are idle load them now
+	CAN_ITConfig(CAN2, CAN_IT_TME, DISABLE);
+	can_tx_fill();
+	CAN_ITConfig(CAN2, CAN_IT_TME, ENABLE);
+}
+
+void can_tx_fill(void) {
+	while (can_tx_queue.out != can_tx_queue.in) {
+		if (CAN_Transmit(CAN2, &can_tx_queue.buf[can_tx_queue.out]) == CAN_TxStatus_NoMailBox) break;
+		can_tx_queue.out = (can_tx_queue.out + 1) & (CAN_TX_QUEUE_SIZE - 1);
+	}
+}
+
+void can_tx_abort(void) {
+	CAN_ITConfig(CAN2, CAN_IT_TME, DISABLE);
+	CAN_CancelTransmit(CAN2, 0);
+	CAN_CancelTransmit(CAN2, 1);
+	CAN_CancelTransmit(CAN2, 2);
+	can_tx_queue.out = can_tx_queue.in;
+	CAN_ITConfig(CAN2, CAN_IT_TME, ENABLE);
+}
+
+void can_flush(void) {
+	// wait until everything queued has been sent, give up (and drop it) if the bus stops taking frames
+	uint32_t start = system_ticks;
+	uint32_t out = can_tx_queue.out;
+
+	while (can_tx_queue.out != can_tx_queue.in || (CAN2->TSR & CAN_TSR_TME) != CAN_TSR_TME) {
+		if (can_tx_queue.out != out) {
+			out = can_tx_queue.out;
+			start = system_ticks;
+		}
+		if (system_ticks - start >= CAN_SEND_TIMEOUT) {
+			can_tx_abort();
+			break;
+		}
+	}
+}
+
+void CAN2_TX_IRQHandler(void) {
+	if (CAN_GetITStatus(CAN2, CAN_IT_TME) == SET) {
+		// clears the request complete flags of all three mailboxes
+		CAN_ClearITPendingBit(CAN2, CAN_IT_TME);
+		can_tx_fill();
+	}
+}
+
+void can_rx_drain(void) {
+	// take frames oldest first across both fifos, so write_segment frames stay in order with the write_packet headers around them
+	while (1) {
+		uint8_t fifo;
+		bool pending0 = CAN_MessagePending(CAN2, CAN_FIFO0) != 0;
+		bool pending1 = CAN_MessagePending(CAN2, CAN_FIFO1) != 0;
+
+		if (pending0 && pending1) {
+			// start of frame time stamps in bit times, both fifos only hold a few frames so they never wrap between them
+			uint16_t time0 = (uint16_t)((CAN2->sFIFOMailBox[CAN_FIFO0].RDTR & CAN_RDT0R_TIME) >> 16);
+			uint16_t time1 = (uint16_t)((CAN2->sFIFOMailBox[CAN_FIFO1].RDTR & CAN_RDT1R_TIME) >> 16);
+			fifo = ((int16_t)(time1 - time0) < 0) ? CAN_FIFO1 : CAN_FIFO0;
+		} else if (pending0) {
+			fifo = CAN_FIFO0;
+		} else if (pending1) {
+			fifo = CAN_FIFO1;
+		} else {
+			break;
+		}
+
+		// a full queue drops the frame, the pending interrupt would fire forever otherwise (windowed writes resend it)
+		if (((can_rx_queue.in + 1) & (CAN_RX_QUEUE_SIZE - 1)) == can_rx_queue.out) {
+			CAN_FIFORelease(CAN2, fifo);
+			continue;
+		}
+
+		CAN_Receive(CAN2, fifo, &can_rx_queue.buf[can_rx_queue.in]);
+		can_rx_queue.in = (can_rx_queue.in + 1) & (CAN_RX_QUEUE_SIZE - 1);
+	}
+}
+
+void CAN2_RX0_IRQHandler(void) {
+	can_rx_drain();
+}
+
+void CAN2_RX1_IRQHandler(void) {
+	can_rx_drain();
+}
+
+bool can_write_receive(CanRxMsg * msg, uint32_t timeout) {
+	// keep committing buffered segments to flash while receiving, give up if the host stops sending
+	uint32_t start = system_ticks;
+
+	while (!can_receive(msg, false)) {
+		can_write_poll();
+		if (system_ticks - start >= timeout) return false;
+	}
+	return true;
+}
+
+void can_write_poll(void) {
+	uint16_t segment;
+	FLASH_Status status;
+	uint32_t crc;
+
+	if (flash_commit_poll(&segment, &status, &crc)) {
+		if (can_write_quiet) {
+			if (status == FLASH_COMPLETE) flash_missing[segment >> 3] &= ~(1 << (segment & 0x7));
+			return;
+		}
+
+		can_tx.Data[0] = (status == FLASH_COMPLETE) ? BOOTLOADER_ACK : BOOTLOADER_NACK;
+		can_tx.Data[1] = (segment >> 0) & 0xFF;
+		can_tx.Data[2] = (segment >> 8) & 0xFF;
+		memcpy(&can_tx.Data[3], &crc, sizeof(crc));
+		can_send(&can_tx, BOOTLOADER_WRITE_COMMIT, 7);
+	}
+}
+
+#if FEATURE_MULTICAST
+void can_multicast_status(uint16_t segments, uint16_t missing, uint8_t status) {
+	can_tx.Data[0] = status;
+	can_tx.Data[1] = (missing >> 0) & 0xFF;
+	can_tx.Data[2] = (missing >> 8) & 0xFF;
+	can_send(&can_tx, BOOTLOADER_WRITE_MULTICAST_STATUS, 3);
+
+	if (missing == 0) return;
+
+	// the bitmap only covers the segments of this write
+	uint8_t bytes = (uint8_t)((segments + 7) / 8);
+	for (uint8_t index = 0; index * 7 < bytes; index++) {
+		uint8_t dlc = (bytes - index * 7 > 7) ? 7 : (uint8_t)(bytes - index * 7);
+		can_tx.Data[0] = index;
+		memcpy(&can_tx.Data[1], &flash_missing[index * 7], dlc);
+		can_send(&can_tx, BOOTLOADER_WRITE_MULTICAST_STATUS, dlc + 1);
+	}
+}
+#endif
+
+void can_window_ack(uint8_t status, uint16_t sequence) {
+	// ack: segments up to sequence received, nack: resend starting at sequence
+	can_tx.Data[0] = status;
+	can_tx.Data[1] = (sequence >> 0) & 0xFF;
+	can_tx.Data[2] = (sequence >> 8) & 0xFF;
+	can_send(&can_tx, BOOTLOADER_WRITE_SEGMENT, 3);
 }
 
 void can_ack(uint8_t command) {
@@ -1087,26 +2349,416 @@ void can_nack(uint8_t command) {
 	can_send(&can_tx, command, 1);
 }
 
+void flash_write_begin(uint32_t address) {
+	for (uint8_t i = 0; i < BOOTLOADER_SEGMENT_BUFFERS; i++) {
+		flash_segments[i].state = FLASH_SEGMENT_FREE;
+	}
+
+	flash_segment_fill = 0;
+	flash_segment_commit = 0;
+	flash_segment_number = 0;
+	flash_write_base = address;
+	flash_write_address = address;
+	flash_commit_status = FLASH_COMPLETE;
+
+	if (address >= APPLICATION_ADDRESS) verify_invalidate();
+
+	CRC_StreamStart(&flash_crc_stream);
+	flash_crc_end = APPLICATION_ADDRESS + APPLICATION_SIZE;
+	flash_crc_valid = (address == APPLICATION_ADDRESS);
+
+	FLASH_PROGRAM_CYCLES = 0;
+	FLASH_PROGRAM_BYTES = 0;
+
+	flash_buffer = flash_segments[flash_segment_fill].data;
+	flash_buffer_index = 0;
+}
+
+void flash_write_queue(void) {
+	FlashSegment_TypeDef * segment = &flash_segments[flash_segment_fill];
+
+	segment->address = flash_write_address;
+	segment->length = flash_buffer_index;
+	segment->number = flash_segment_number++;
+	segment->state = FLASH_SEGMENT_FILLED;
+
+	flash_write_address += flash_buffer_index;
+
+	// the transport fills the next buffer once it is free
+	flash_segment_fill = (flash_segment_fill + 1) % BOOTLOADER_SEGMENT_BUFFERS;
+	flash_buffer = flash_segments[flash_segment_fill].data;
+	flash_buffer_index = 0;
+}
+
+void flash_write_resume(void) {
+	// pick up after the last segment in the journal, the sectors it erased hold committed data and must not be erased again
+	flash_write_address = flash_write_base + RtcUserData.journal_offset;
+	flash_segment_number = RtcUserData.journal_segment;
+	flash_erased_sectors = RtcUserData.journal_erased;
+
+	flash_crc_stream.crc = RtcUserData.journal_crc;
+	flash_crc_stream.word = RtcUserData.journal_crc_word;
+	flash_crc_stream.length = RtcUserData.journal_crc_length;
+	flash_crc_valid = flash_crc_valid && RtcUserData.journal_crc_length != 0xFFFFFFFF;
+
+	// the header has already been committed, the crc ends at the image length
+	if (flash_crc_valid && RtcUserData.journal_offset >= sizeof(FlashApplicationData)) {
+		FLASH_ReadApplicationData();
+		if (FlashApplicationData.length <= APPLICATION_SIZE) flash_crc_end = APPLICATION_ENTRY_POINT_ADDRESS + FlashApplicationData.length;
+	}
+}
+
+void flash_write_end(void) {
+	// the sectors written to are no longer blank, the next write has to erase them again
+	flash_erased_sectors = 0;
+}
+
+#if FEATURE_COMPRESSED
+void flash_write_decompress_begin(uint32_t length) {
+	LZ_DecodeStart(&flash_lz, length);
+	memset(flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+}
+
+bool flash_write_decompress(uint8_t * data, uint32_t length, poll_function poll) {
+	// decode into the segment buffer, queueing it whenever it fills or the image is complete
+	while (flash_lz.state != LZ_STATE_DONE) {
+		uint32_t decoded = BOOTLOADER_SEGMENT_SIZE - flash_buffer_index;
+		uint32_t used = LZ_Decode(&flash_lz, data, length, &flash_buffer[flash_buffer_index], &decoded);
+		if (flash_lz.state == LZ_STATE_ERROR) return false;
+
+		data += used;
+		length -= used;
+		flash_buffer_index += decoded;
+
+		if (flash_buffer_index == BOOTLOADER_SEGMENT_SIZE || flash_lz.state == LZ_STATE_DONE) {
+			flash_write_queue();
+			while (!flash_write_ready()) poll();
+
+			// a failed commit is reported by the caller from flash_commit_status
+			if (flash_commit_status != FLASH_COMPLETE) break;
+			memset(flash_buffer, 0xFF, BOOTLOADER_SEGMENT_SIZE);
+		} else if (length == 0) {
+			// the rest of the segment is in the next packet
+			break;
+		}
+	}
+
+	return true;
+}
+#endif
+
+#if FEATURE_DELTA
+bool flash_write_delta_base(uint32_t crc) {
+	// no base, a repair of an installed image that doesn't verify (e.g. a bad committed segment), the kept sectors
+	// can't be checked up front but are read into the image crc, so the verify at the end still covers them
+	if (crc == 0) return true;
+
+	// the delta only applies to the image it was made against, and that image has to be intact
+	FLASH_ReadApplicationData();
+	return FlashApplicationData.crc == crc && verify_application_cached();
+}
+
+bool flash_write_keep(uint32_t length, bool last, poll_function poll) {
+	uint32_t address = flash_write_address;
+	uint32_t end = address + length;
+
+	// only whole sectors can be left alone, anything sharing a sector with new data is erased with it,
+	// the last sector of the image may run past its end
+	if (FLASH_GetSector(address - 1) == FLASH_GetSector(address)) return false;
+	if (!last && FLASH_GetSector(end - 1) == FLASH_GetSector(end)) return false;
+	for (uint16_t sector = FLASH_GetSector(address); sector <= FLASH_GetSector(end - 1); sector += 0x8) {
+		if (flash_erased_sectors & (1 << (sector >> 3))) return false;
+	}
+
+	// the image crc is built up in order, so everything before the kept range has to be committed first
+	while (!flash_write_idle()) poll();
+	if (flash_commit_status != FLASH_COMPLETE) return false;
+
+	flash_crc_update(address, length);
+	flash_write_address = end;
+
+	return true;
+}
+#endif
+
+bool flash_write_skip(uint32_t length, poll_function poll) {
+	uint32_t address = flash_write_address;
+
+	// the image crc is built up in order, so everything before the gap has to be committed first
+	while (!flash_write_idle()) poll();
+	if (flash_commit_status != FLASH_COMPLETE) return false;
+
+	// the gap is left erased, sectors nothing else lands in still need erasing (sectors already erased by this write are skipped)
+	flash_commit_status = flash_erase(address, length);
+	if (flash_commit_status != FLASH_COMPLETE) return false;
+
+	flash_crc_update(address, length);
+	flash_write_address += length;
+
+	return true;
+}
+
+bool flash_write_ready(void) {
+	if (flash_segments[flash_segment_fill].state != FLASH_SEGMENT_FREE) return false;
+
+	// nothing can be received while a sector is being erased, so the next segment is held off
+	// (not acked) until every queued segment that needs an erase has had it done
+	for (uint8_t i = 0; i < BOOTLOADER_SEGMENT_BUFFERS; i++) {
+		FlashSegment_TypeDef * segment = &flash_segments[i];
+		if (segment->state == FLASH_SEGMENT_FILLED && !flash_erased(segment->address, segment->length)) return false;
+	}
+
+	return true;
+}
+
+bool flash_write_idle(void) {
+	// segments are committed in order, so if the oldest one is free they all are
+	return flash_segments[flash_segment_commit].state == FLASH_SEGMENT_FREE;
+}
+
+bool flash_commit_poll(uint16_t * number, FLASH_Status * status, uint32_t * crc) {
+	FlashSegment_TypeDef * segment = &flash_segments[flash_segment_commit];
+
+	if (segment->state == FLASH_SEGMENT_FREE) return false;
+
+	if (flash_commit_status == FLASH_COMPLETE) {
+		if (segment->state == FLASH_SEGMENT_FILLED) {
+			flash_commit_status = flash_erase(segment->address, segment->length);
+			if (flash_commit_status == FLASH_COMPLETE) FLASH_ProgramStart(&flash_program, segment->address, segment->data, segment->length);
+			segment->state = FLASH_SEGMENT_COMMITTING;
+		}
+
+		// program a few words per call so the transport keeps getting serviced
+		if (flash_commit_status == FLASH_COMPLETE) {
+			FLASH_Status result = FLASH_ProgramContinue(&flash_program, FLASH_COMMIT_WORDS);
+			if (result == FLASH_BUSY) return false;
+			flash_commit_status = result;
+
+			if (flash_commit_status == FLASH_COMPLETE) {
+				flash_crc_update(segment->address, segment->length);
+				journal_commit(segment);
+			}
+		}
+	}
+
+	// segment is committed (or failed, in which case every remaining segment fails too)
+	*number = segment->number;
+	*status = flash_commit_status;
+	// crc of what actually ended up in flash, so the host can compare it against what it sent
+	*crc = (flash_commit_status == FLASH_COMPLETE) ? CRC_CalcDataCRC(segment->address, segment->length) : 0;
+
+	segment->state = FLASH_SEGMENT_FREE;
+	flash_segment_commit = (flash_segment_commit + 1) % BOOTLOADER_SEGMENT_BUFFERS;
+
+	return true;
+}
+
+void flash_crc_update(uint32_t address, uint32_t length) {
+	if (!flash_crc_valid) return;
+
+	// once the header is in flash the image length is known, the crc stops there
+	if (address <= APPLICATION_ADDRESS && address + length >= APPLICATION_ADDRESS + sizeof(FlashApplicationData)) {
+		FLASH_ReadApplicationData();
+		if (FlashApplicationData.length <= APPLICATION_SIZE) flash_crc_end = APPLICATION_ENTRY_POINT_ADDRESS + FlashApplicationData.length;
+	}
+
+	// only the body of the image is covered by its crc
+	uint32_t end = address + length;
+	if (address < APPLICATION_ENTRY_POINT_ADDRESS) address = APPLICATION_ENTRY_POINT_ADDRESS;
+	if (end > flash_crc_end) end = flash_crc_end;
+	if (address >= end) return;
+
+	if (address != APPLICATION_ENTRY_POINT_ADDRESS + flash_crc_stream.length) {
+		flash_crc_valid = false;
+		return;
+	}
+
+	// read back out of flash so the crc is of what was actually programmed
+	CRC_StreamUpdate(&flash_crc_stream, (uint8_t *)address, end - address);
+}
+
+bool flash_region_range(uint8_t region, uint32_t offset, uint32_t length, uint32_t * address) {
+	// the bootloader can be read but never written
+	if (region != FLASH_REGION_USER_DATA && region != FLASH_REGION_APPLICATION) return false;
+
+	return flash_region_read_range(region, offset, length, address);
+}
+
+bool flash_region_read_range(uint8_t region, uint32_t offset, uint32_t length, uint32_t * address) {
+	if (region == 0 || region >= sizeof(FLASH_REGION_MAP) / sizeof(FLASH_REGION_MAP[0])) return false;
+
+	uint32_t size = FLASH_REGION_MAP[region][1];
+	if (offset > size || length > size - offset) return false;
+
+	*address = FLASH_REGION_MAP[region][0] + offset;
+	return true;
+}
+
+bool flash_address_range(uint32_t address, uint32_t length) {
+	for (uint8_t region = 1; region < sizeof(FLASH_REGION_MAP) / sizeof(FLASH_REGION_MAP[0]); region++) {
+		uint32_t start = FLASH_REGION_MAP[region][0];
+		uint32_t size = FLASH_REGION_MAP[region][1];
+
+		if (address >= start && address - start <= size && length <= size - (address - start)) return true;
+	}
+
+	return false;
+}
+
+FLASH_Status flash_rewrite(uint32_t address, uint8_t * data, uint16_t length) {
+	// flash bits can only be programmed from 1 to 0 without erasing the sector (and everything else in it),
+	// so a rewrite only works into blank flash or over data that only needs bits cleared
+	for (uint16_t i = 0; i < length; i++) {
+		if ((*((uint8_t *)(address + i)) & data[i]) != data[i]) return FLASH_ERROR_PROGRAM;
+	}
+
+	if (address >= APPLICATION_ADDRESS) verify_invalidate();
+
+	// the sectors are no longer blank, a later write has to erase them again
+	for (uint16_t sector = FLASH_GetSector(address); sector <= FLASH_GetSector(address + length - 1); sector += 0x8) {
+		flash_erased_sectors &= ~(1 << (sector >> 3));
+	}
+
+	// an interrupted write would resume into its uncommitted range expecting it to be blank
+	uint32_t journal_address;
+	if (flash_region_range(RtcUserData.journal_region, 0, RtcUserData.journal_length, &journal_address) &&
+		address + length > journal_address + RtcUserData.journal_offset && address < journal_address + RtcUserData.journal_length) {
+		journal_clear();
+	}
+
+	FLASH_Status status = FLASH_ProgramData(address, data, length);
+	if (status != FLASH_COMPLETE) return status;
+
+	if (memcmp((uint8_t *)address, data, length) != 0) return FLASH_ERROR_PROGRAM;
+
+	return FLASH_COMPLETE;
+}
+
+void journal_begin(uint8_t region, uint32_t length) {
+	RtcUserData.journal_region = region;
+	RtcUserData.journal_erased = 0;
+	RtcUserData.journal_segment = 0;
+	RtcUserData.journal_length = length;
+	RtcUserData.journal_offset = 0;
+	RtcUserData.journal_crc = flash_crc_stream.crc;
+	RtcUserData.journal_crc_word = flash_crc_stream.word;
+	RtcUserData.journal_crc_length = flash_crc_valid ? flash_crc_stream.length : 0xFFFFFFFF;
+	RTC_WriteBackupRegisters();
+}
+
+bool journal_resume(uint8_t region, uint32_t length) {
+	return RtcUserData.journal_region == region && RtcUserData.journal_length == length &&
+		RtcUserData.journal_offset != 0 && RtcUserData.journal_offset < length;
+}
+
+void journal_commit(FlashSegment_TypeDef * segment) {
+	// nothing is being journaled (a compressed or delta write, or the journal was dropped part way)
+	if (RtcUserData.journal_region == 0) return;
+
+	// the backup registers survive resets and link loss, so this is everything needed to carry on after this segment
+	RtcUserData.journal_erased = flash_erased_sectors;
+	RtcUserData.journal_segment = segment->number + 1;
+	RtcUserData.journal_offset = segment->address + segment->length - flash_write_base;
+	RtcUserData.journal_crc = flash_crc_stream.crc;
+	RtcUserData.journal_crc_word = flash_crc_stream.word;
+	RtcUserData.journal_crc_length = flash_crc_valid ? flash_crc_stream.length : 0xFFFFFFFF;
+	RTC_WriteBackupRegisters();
+}
+
+void journal_clear(void) {
+	if (RtcUserData.journal_region == 0) return;
+
+	RtcUserData.journal_region = 0;
+	RTC_WriteBackupRegisters();
+}
+
+void flash_user_data_written(void) {
+	uint16_t bit = (1 << (USER_DATA_FLASH_SECTOR >> 3));
+
+	// the sector is no longer blank, neither this write nor a resumed one may program it without erasing it again
+	flash_erased_sectors &= ~bit;
+	if (RtcUserData.journal_region == FLASH_REGION_USER_DATA) journal_clear();
+	if (RtcUserData.journal_erased & bit) {
+		RtcUserData.journal_erased &= ~bit;
+		RTC_WriteBackupRegisters();
+	}
+}
+
 FLASH_Status erase(uint8_t type) {
 	FLASH_Status status = FLASH_COMPLETE;
 
-	FLASH_Unlock();
+	// whatever was committed is about to be erased, there is nothing left to resume
+	if (RtcUserData.journal_region == type) journal_clear();
+
 	if (type == FLASH_REGION_USER_DATA) {
-		status = FLASH_EraseSector(FLASH_GetSector(USER_DATA_ADDRESS), VoltageRange_3);
+		flash_erased_sectors &= ~(1 << (USER_DATA_FLASH_SECTOR >> 3));
+		status = flash_erase(USER_DATA_ADDRESS, USER_DATA_SIZE);
 	} else if (type == FLASH_REGION_APPLICATION) {
-		status = FLASH_EraseSectors(APPLICATION_FLASH_SECTOR, FLASH_GetSector(FLASH_REGION_END), VoltageRange_3);
+		// the whole region, so nothing of the old image can be read back, a write that follows finds every sector
+		// already erased (a write without an erase first erases each sector on demand as segments land in it)
+		for (uint16_t sector = APPLICATION_FLASH_SECTOR; sector <= FLASH_GetSector(APPLICATION_ADDRESS + APPLICATION_SIZE - 1); sector += 0x8) {
+			flash_erased_sectors &= ~(1 << (sector >> 3));
+		}
+		verify_invalidate();
+		status = flash_erase(APPLICATION_ADDRESS, APPLICATION_SIZE);
+	}
+
+	return status;
+}
+
+bool flash_erased(uint32_t address, uint32_t length) {
+	if (length == 0) return true;
+
+	for (uint16_t sector = FLASH_GetSector(address); sector <= FLASH_GetSector(address + length - 1); sector += 0x8) {
+		if ((flash_erased_sectors & (1 << (sector >> 3))) == 0) return false;
+	}
+
+	return true;
+}
+
+FLASH_Status flash_erase(uint32_t address, uint32_t length) {
+	FLASH_Status status = FLASH_COMPLETE;
+
+	if (length == 0) return status;
+
+	// erase every sector in the range that hasn't been erased since the last write
+	FLASH_Unlock();
+	for (uint16_t sector = FLASH_GetSector(address); sector <= FLASH_GetSector(address + length - 1); sector += 0x8) {
+		if (flash_erased_sectors & (1 << (sector >> 3))) continue;
+
+		status = FLASH_EraseSector(sector, VoltageRange_3);
+		if (status != FLASH_COMPLETE) break;
+
+		flash_erased_sectors |= (1 << (sector >> 3));
 	}
 	FLASH_Lock();
 
 	return status;
 }
 
+uint8_t flash_sector_digest(uint32_t * crc) {
+	uint32_t end = FLASH_GetEndAddress();
+	uint8_t count = 0;
+
+	// crc of each whole sector, so the host can tell which ones differ from its image without reading them back
+	for (uint16_t sector = APPLICATION_FLASH_SECTOR; sector <= FLASH_Sector_11; sector += 0x8) {
+		uint32_t address = FLASH_GetSectorAddress(sector);
+		if (address >= end) break;
+
+		uint32_t next = (sector == FLASH_Sector_11) ? end : FLASH_GetSectorAddress(sector + 0x8);
+		if (next > end) next = end;
+
+		crc[count++] = CRC_CalcDataCRC(address, next - address);
+	}
+
+	return count;
+}
+
 bool verify_application(void) {
 	uint32_t magic = FlashApplicationData.magic;
 	uint32_t crc = FlashApplicationData.crc;
 	uint32_t length = FlashApplicationData.length;
 	uint32_t address = APPLICATION_ENTRY_POINT_ADDRESS;
-	uint8_t size = 0;
 
 	if (magic != FLASH_APPLICATION_DATA_MAGIC) {
 		return false;
@@ -1120,34 +2772,78 @@ bool verify_application(void) {
 		return false;
 	}
 
-	CRC_ResetDR();
+	uint32_t crc32 = CRC_CalcDataCRC(address, length);
 
-	uint32_t crc32 = 0;
-
-	while (length != 0) {
-		if (length >= sizeof(uint32_t)) size = sizeof(uint32_t);
-		else if (length >= sizeof(uint16_t)) size = sizeof(uint16_t);
-		else if (length >= sizeof(uint8_t)) size = sizeof(uint8_t);
+	if (crc == crc32) {
+		verify_stamp(crc, length);
+		return true;
+	} else {
+		verify_invalidate();
+		return false;
+	}
+}
 
-		if (size == sizeof(uint32_t)) crc32 = CRC_CalcCRC(*((uint32_t *)(address)));
-		else if (size == sizeof(uint16_t)) crc32 = CRC_CalcCRC(*((uint16_t *)(address)));
-		else if (size == sizeof(uint8_t)) crc32 = CRC_CalcCRC(*((uint8_t *)(address)));
+bool verify_application_cached(void) {
+	uint32_t crc = FlashApplicationData.crc;
+	uint32_t length = FlashApplicationData.length;
 
-		address += size;
-		length -= size;
+	// the image was verified before a warm reset and nothing has been erased or written since
+	if (FlashApplicationData.magic == FLASH_APPLICATION_DATA_MAGIC &&
+		RtcUserData.verified_token != 0 &&
+		RtcUserData.verified_token == RTC_VERIFIED_TOKEN(crc, length) &&
+		RtcUserData.verified_crc == crc &&
+		RtcUserData.verified_length == length) {
+		return true;
 	}
 
-	crc32 = CRC_GetCRC();
+	return verify_application();
+}
 
-	if (crc == crc32) {
+bool verify_application_written(void) {
+	uint32_t magic = FlashApplicationData.magic;
+	uint32_t crc = FlashApplicationData.crc;
+	uint32_t length = FlashApplicationData.length;
+
+	// the body crc was built up as the write was committed, if that covered the whole image it only needs comparing,
+	// otherwise (partial write, out of order segments) read the image back
+	if (!flash_crc_valid || magic != FLASH_APPLICATION_DATA_MAGIC || crc == 0 || crc == 0xFFFFFFFF ||
+		length == 0 || flash_crc_stream.length != length) {
+		return verify_application();
+	}
+
+	if (CRC_StreamFinish(&flash_crc_stream) == crc) {
+		verify_stamp(crc, length);
 		return true;
 	} else {
+		verify_invalidate();
 		return false;
 	}
 }
 
+void verify_stamp(uint32_t crc, uint32_t length) {
+	// stamp the image so warm resets can skip the crc
+	RtcUserData.verified_crc = crc;
+	RtcUserData.verified_length = length;
+	RtcUserData.verified_token = RTC_VERIFIED_TOKEN(crc, length);
+	RTC_WriteBackupRegisters();
+}
+
+void verify_invalidate(void) {
+	if (RtcUserData.verified_token == 0) return;
+
+	RtcUserData.verified_token = 0;
+	RTC_WriteBackupRegisters();
+}
+
 void execute_application(void) {
 	// deinit peripherals
+	SysTick->CTRL = 0;
+
+	// the can fifos keep receiving, their interrupts must not fire into the application before it has set them up
+	NVIC_DisableIRQ(CAN2_TX_IRQn);
+	NVIC_DisableIRQ(CAN2_RX0_IRQn);
+	NVIC_DisableIRQ(CAN2_RX1_IRQn);
+	CAN_DeInit(CAN2);
 
 	uint32_t address = APPLICATION_ENTRY_POINT_ADDRESS;
 	uint32_t stack_pointer;
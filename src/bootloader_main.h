@@ -30,18 +30,29 @@
 #include "stm32f4xx_can.h"
 #include "stm32f4xx_usart.h"
 #include "stm32f4xx_crc.h"
+#include "stm32f4xx_dma.h"
+#include "stm32f4xx_exti.h"
+#include "stm32f4xx_syscfg.h"
+#include "misc.h"
 
 #define BUILD_VERSION					0x1
 
 // commands
 #define BOOTLOADER_NACK					0x00
 #define BOOTLOADER_VERSION				0x01 // N/A <=> ack/nack, version
-#define BOOTLOADER_SPEED				0x02 // 1 byte speed <=> ack/nack, ack/nack?
+#define BOOTLOADER_SPEED				0x02 // 1 byte speed, (usart, USART_Custom) 4 byte baud rate <=> ack/nack, (usart) then ack <=> ack at the new rate
+												 // (the bootloader goes back to the old rate if that doesn't arrive within USART_SPEED_TIMEOUT)
+												 // (can, CAN_Custom) 2 byte prescaler, 1 byte bs1, 1 byte bs2, 1 byte sjw (in time quanta)
 #define BOOTLOADER_ERASE				0x03 // 1 byte flash region <=> ack/nack, ack/nack
 #define BOOTLOADER_READ					0x04 // 1 byte flash region, 4 byte length <=> ack/nack, X bytes, ack/nack
 #define BOOTLOADER_READ_SEGMENT			0x05 // N/A <=> 8 bytes data
-#define BOOTLOADER_WRITE				0x06 // 1 byte flash region, 4 byte length <=> ack/nack, X ack/nacks, ack/nack
-#define BOOTLOADER_WRITE_SEGMENT		0x07 // N/A <=> ack/nack
+#define BOOTLOADER_READ_RANGE			0x1B // (usart) 1 byte flash region, 4 byte offset, 4 byte length (can) 1 byte flash region, 4 byte offset, 3 byte length
+												 // <=> ack/nack, (usart) X bytes (can) BOOTLOADER_READ_SEGMENT frames, ack
+#define BOOTLOADER_CHECKSUM				0x1C // 4 byte address, 4 byte length (within one flash region) <=> ack/nack, 4 byte crc of the range
+#define BOOTLOADER_SECTOR_DIGEST		0x1D // N/A <=> ack, 1 byte first sector, 1 byte sector count, then a 4 byte crc for each sector
+												 // from the start of the application to the end of flash ((can) two crcs per frame)
+#define BOOTLOADER_WRITE				0x06 // 1 byte flash region, 4 byte length, (can) 1 byte write mode <=> ack/nack, (windowed) 1 byte window, X ack/nacks, ack/nack
+#define BOOTLOADER_WRITE_SEGMENT		0x07 // N/A <=> ack/nack (segment received, send the next one), (windowed) 2 byte sequence number
 #define BOOTLOADER_VERIFY				0x08 // <=> ack/nack, ack/nack
 #define BOOTLOADER_EXECUTE				0x09 // <=> ack/nack
 #define BOOTLOADER_SECURE				0x0A // 1 byte flash region, 1 byte secure type, 1 byte secure access type
@@ -50,20 +61,139 @@
 #define BOOTLOADER_SAVE_KEYS			0x0D // <=> ack
 #define BOOTLOADER_RESET				0x0E // 1 byte reset type <=> ack/nack
 #define BOOTLOADER_ACK					0x0F // bootloader: ack <=> ack, firmware: ack <=> nack
+#define BOOTLOADER_WRITE_PACKET			0x10 // (usart, in place of BOOTLOADER_WRITE_SEGMENT) 4 byte offset, 2 byte length, X bytes data, 4 byte crc <=> ack/nack
+												 // (can windowed, ahead of each segment's BOOTLOADER_WRITE_SEGMENT frames) 2 byte sequence number, 2 byte length, optional 4 byte crc
+#define BOOTLOADER_WRITE_COMMIT			0x11 // N/A <=> ack/nack, 2 byte segment number, 4 byte crc of the segment as read back from flash (sent as each segment is written to flash)
+#define BOOTLOADER_WRITE_QUERY			0x13 // N/A <=> ack, 1 byte flash region (0 = nothing to resume), 4 byte length, 2 byte segment number, 4 byte offset, 4 byte crc of flash up to offset
+#define BOOTLOADER_WRITE_RESUME			0x14 // same as BOOTLOADER_WRITE <=> ack/nack, (can) 1 byte window, 4 byte offset, 2 byte segment number, then as BOOTLOADER_WRITE from offset
+#define BOOTLOADER_WRITE_COMPRESSED		0x15 // same as BOOTLOADER_WRITE with the decompressed length <=> ack/nack, the data is an lz4 block decompressed as it arrives
+												 // (usart BOOTLOADER_WRITE_PACKET, can windowed only) packet lengths and offsets/sequences count compressed bytes,
+												 // match offsets must be at most LZ_WINDOW_SIZE (4 KB), which a stock lz4 doesn't respect, compress the image as
+												 // one block with liblz4 built with -DLZ4_DISTANCE_MAX=4096 (LZ4_compress_default/LZ4_compress_HC)
+#define BOOTLOADER_WRITE_DELTA			0x16 // (usart) 1 byte flash region (application only), 4 byte length, 4 byte crc of the installed image <=> ack/nack, then as BOOTLOADER_WRITE
+												 // (can) 4 byte length, 4 byte crc of the installed image <=> ack/nack, 1 byte window, then as a windowed BOOTLOADER_WRITE
+												 // nacked unless the installed image is intact and has that crc, unchanged sectors are sent as BOOTLOADER_WRITE_KEEP,
+												 // a crc of 0 repairs an image that doesn't verify: only the bad sectors (see BOOTLOADER_SECTOR_DIGEST) are sent,
+												 // the kept ones are only checked by the verify at the end
+#define BOOTLOADER_WRITE_KEEP			0x17 // (usart, in place of a packet) 4 byte offset, 4 byte length (can windowed) 2 byte sequence number, 4 byte length <=> as a segment
+												 // leaves whole sectors as the installed image has them, the last one may run past the end of the new image
+#define BOOTLOADER_WRITE_SKIP			0x18 // (usart, in place of a segment/packet) 4 byte offset, 4 byte length (can windowed) 2 byte sequence number, 4 byte length <=> as a segment
+												 // leaves the range erased (not in compressed writes), so runs of 0xFF padding don't have to be sent
+#define BOOTLOADER_WRITE_MULTICAST		0x19 // (can, usually broadcast) 1 byte flash region, 4 byte length <=> ack/nack once the region is erased, then 1k segments as
+												 // BOOTLOADER_WRITE_PACKET (2 byte segment number, 2 byte length, 4 byte crc) and BOOTLOADER_WRITE_SEGMENT frames, in any order, nothing is acked
+#define BOOTLOADER_WRITE_MULTICAST_STATUS	0x1A // (can, during a multicast write) N/A <=> ack/nack, 2 byte missing segment count, then (if any are missing) frames of
+												 // 1 byte index, 7 bytes of the missing segment bitmap (bit n = segment n), the write ends (and is verified) once nothing is missing,
+												 // (outside of one) nack, 0xFFFF, 1 byte MULTICAST_SESSION_x of how the last multicast write ended
+#define BOOTLOADER_REWRITE				0x12 // 1 byte flash region, 4 byte offset, 2 byte length, X bytes data, (usart) 4 byte crc <=> ack/nack, 4 byte crc of the range as read back from flash
+												 // (can, data follows in BOOTLOADER_WRITE_SEGMENT frames) only succeeds into blank or bit compatible (1 -> 0 only) flash,
+												 // anything else is nacked without writing, to repair committed data send its sector again with
+												 // BOOTLOADER_WRITE_DELTA with a crc of 0 (BOOTLOADER_WRITE_KEEP for the rest of the image)
 
 // amount of memory to buffer before writing to flash
 #define BOOTLOADER_SEGMENT_SIZE			1024
+// number of segment buffers, one is received into while the others are written to flash
+#define BOOTLOADER_SEGMENT_BUFFERS		4
+
+// can write modes
+#define WRITE_MODE_STOP_AND_WAIT		0x00 // one segment at a time, acked after it is buffered
+#define WRITE_MODE_WINDOWED				0x01 // sequence numbered segments, acked cumulatively, lost segments are resent (go back n)
+// segments a windowed host may have sent beyond the last ack, one buffer is always being received into
+#define CAN_WRITE_WINDOW				(BOOTLOADER_SEGMENT_BUFFERS - 1)
+
+// usart receive ring buffer (filled by dma), size must be a power of 2
+#define USART_RX_BUFFER_SIZE			4096
+// usart transmit staging buffers (two, one is filled while the other is sent by dma)
+#define USART_TX_BUFFER_SIZE			256
+
+#if USART_RX_BUFFER_SIZE < 2
+#error USART_RX_BUFFER_SIZE is too small. It must be larger than 1.
+#elif ((USART_RX_BUFFER_SIZE & (USART_RX_BUFFER_SIZE - 1)) != 0)
+#error USART_RX_BUFFER_SIZE must be a power of 2.
+#endif
+
+// can transmit queue, drained into the three tx mailboxes from the tx mailbox empty interrupt, size must be a power of 2
+#define CAN_TX_QUEUE_SIZE				64
+
+#if ((CAN_TX_QUEUE_SIZE & (CAN_TX_QUEUE_SIZE - 1)) != 0)
+#error CAN_TX_QUEUE_SIZE must be a power of 2.
+#endif
+
+// can receive queue, filled from both rx fifos by the fifo message pending interrupts, size must be a power of 2
+// (room for a full segment of write_segment frames and its write_packet header while flash is being programmed)
+#define CAN_RX_QUEUE_SIZE				256
+
+#if ((CAN_RX_QUEUE_SIZE & (CAN_RX_QUEUE_SIZE - 1)) != 0)
+#error CAN_RX_QUEUE_SIZE must be a power of 2.
+#endif
+
+// usart3 dma request mapping (en.DM00031020-RM0090-STM32F4xx_EVAL, DMA1 request mapping table)
+#define USART_DMA_CHANNEL				DMA_Channel_4
+#define USART_RX_DMA_STREAM				DMA1_Stream1
+#define USART_TX_DMA_STREAM				DMA1_Stream3
+#define USART_TX_DMA_FLAGS				(DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_FEIF3)
+// usart3 rx pin (must match pincfg_usart3_init), its edges are timed through exti to detect the host's baud rate
+#define USART_RX_EXTI_PORT_SOURCE		EXTI_PortSourceGPIOB
+#define USART_RX_EXTI_PIN_SOURCE		EXTI_PinSource11
+#define USART_RX_EXTI_LINE				EXTI_Line11
+#define USART_RX_EXTI_IRQn				EXTI15_10_IRQn
+// a rate is only used if pclk1 / (pclk1 cycles per bit) is within 1/USART_RATE_TOLERANCE of it
+#define USART_RATE_TOLERANCE			50
+// ms to wait for the host's ack at a new rate before going back to the old one
+#define USART_SPEED_TIMEOUT				500
+
+// a measured rate within 1/USART_AUTOBAUD_SNAP of a standard rate is taken to be that rate
+#define USART_AUTOBAUD_SNAP				32
+// slowest rate detected, anything slower is taken to be noise
+#define USART_AUTOBAUD_MIN				9600
+// shortest bit (in core cycles) the edge interrupt is trusted to time, about 12 cycles of entry and 30 of handler
+// with a 3x margin, i.e. up to about 1.3 Mbps at 168 MHz, faster hosts switch with BOOTLOADER_SPEED instead
+#define USART_AUTOBAUD_BIT_CYCLES_MIN	128
+
+// time base, system_ticks is incremented by SysTick once per ms
+#define SYSTEM_TICK_RATE				1000
+// a write is abandoned (nacked) if the host stops sending for this many ms in the middle of it
+#define BOOTLOADER_WRITE_TIMEOUT		1000
+// a multicast write is dropped if the host stops sending for this many ms, it can be quiet for a while polling other nodes for their status
+#define BOOTLOADER_MULTICAST_TIMEOUT	10000
+// a windowed write nacks the next segment it expects after this many quiet ms, in case the host is waiting on acks for frames that were lost
+#define BOOTLOADER_WRITE_IDLE_TIMEOUT	100
+// ms to wait for a can frame to be acknowledged on the bus before giving up on it
+#define CAN_SEND_TIMEOUT				100
+
+// limits on custom can bit timing (AN1798), time quanta per bit and sample point in percent of the bit
+#define CAN_BIT_RATE_MAX				1000000
+#define CAN_QUANTA_MIN					8
+#define CAN_QUANTA_MAX					25
+#define CAN_SAMPLE_POINT_MIN			50
+#define CAN_SAMPLE_POINT_MAX			90
+// optional ms pause before each usart ack/nack, for hosts that can't turn the line around quickly
+// 0 sends responses as soon as the work is done
+#define USART_RESPONSE_PACING			0
 
 #define FLASH_REGION_BOOTLOADER			0x01
 #define FLASH_REGION_USER_DATA			0x02
 #define FLASH_REGION_APPLICATION		0x03
 
+// most sectors a digest can cover, from the application sector up to sector 11 on 1 MB parts
+#define FLASH_SECTOR_DIGEST_MAX			(((FLASH_Sector_11 - APPLICATION_FLASH_SECTOR) >> 3) + 1)
+
+// address and size of each flash region, indexed by FLASH_REGION_x
+const uint32_t FLASH_REGION_MAP[4][2] = {
+	{ 0, 0 },
+	{ BOOTLOADER_ADDRESS, BOOTLOADER_SIZE },
+	{ USER_DATA_ADDRESS, USER_DATA_SIZE },
+	{ APPLICATION_ADDRESS, APPLICATION_SIZE },
+};
+
 #define SECURE_TYPE_PROTECT				0x01
 #define SECURE_TYPE_UNPROTECT			0x02
 
 #define SECURE_ACCESS_TYPE_READ			0x01
 #define SECURE_ACCESS_TYPE_WRITE		0x02
 
+#define MULTICAST_SESSION_NONE			0x00 // no multicast write, or the last one completed or was ended by the host
+#define MULTICAST_SESSION_DROPPED		0x01 // the host was quiet for BOOTLOADER_MULTICAST_TIMEOUT, the write is incomplete
+
 #define RESET_TYPE_PARALLAX_BOOTLOADER	0x01
 #define RESET_TYPE_STM32_BOOTLOADER		0x02
 
@@ -73,6 +203,9 @@
 #define KEY_BOARD_PART_NUMBER			0x04
 #define KEY_BOARD_SERIAL_NUMBER			0x05
 #define KEY_BOARD_MANUFACTURE_DATE		0x06
+#define KEY_FLASH_PROGRAM_CYCLES		0x07 // read only, cpu cycles per KB programmed during the last write
+#define KEY_CRC_CYCLES					0x08 // read only, cpu cycles per KB of the last crc calculation (e.g. verify or BOOTLOADER_CHECKSUM),
+												 // a word aligned range is fed by dma, an unaligned one by the cpu, so the two can be compared on target
 
 uint8_t CAN_COMMAND_TYPE;
 uint8_t CAN_COMMAND;
@@ -88,39 +221,211 @@ uint8_t CAN_PRIORITY;
 uint8_t BOARD_ID = 0;
 uint8_t NODE_ID = 0;
 
+volatile uint32_t system_ticks = 0;
+
+// rate the usart is running at
+uint32_t usart_baud_rate = 0;
+
+// cycle counter at the last four edges on the usart rx pin, and the rate of the ack byte they matched (0 until one has)
+uint32_t usart_autobaud_edges[4];
+uint8_t usart_autobaud_count = 0;
+volatile uint32_t usart_autobaud_rate = 0;
+const uint32_t USART_AUTOBAUD_RATES[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1000000 };
+
+// if in == out the buffer is empty, (in - out) & (USART_RX_BUFFER_SIZE - 1) is the number of bytes in the buffer
+// in is the dma write position, out is the read position
+struct usart_buf_st {
+	volatile uint32_t in;
+	volatile uint32_t out;
+	uint8_t buf[USART_RX_BUFFER_SIZE];
+};
+
+struct usart_buf_st usart_rx_buffer = { 0, 0, };
+// dma write position at the last idle line, i.e. the end of the last complete frame
+volatile uint32_t usart_rx_frame = 0;
+
+uint8_t usart_tx_buffer[2][USART_TX_BUFFER_SIZE];
+uint8_t usart_tx_buffer_active = 0;
+uint16_t usart_tx_buffer_index = 0;
+
+// if in == out the queue is empty, in is written by can_send, out by can_tx_fill
+struct can_tx_queue_st {
+	volatile uint32_t in;
+	volatile uint32_t out;
+	CanTxMsg buf[CAN_TX_QUEUE_SIZE];
+};
+
+struct can_tx_queue_st can_tx_queue = { 0, 0, };
+
+struct can_rx_queue_st {
+	volatile uint32_t in;
+	volatile uint32_t out;
+	CanRxMsg buf[CAN_RX_QUEUE_SIZE];
+};
+
+struct can_rx_queue_st can_rx_queue = { 0, 0, };
+
 uint16_t usart_rx;
 uint8_t usart_tx;
 CanRxMsg can_rx;
 CanTxMsg can_tx;
 
-uint8_t flash_buffer[BOOTLOADER_SEGMENT_SIZE];
+#define FLASH_SEGMENT_FREE				0x00
+#define FLASH_SEGMENT_FILLED			0x01
+#define FLASH_SEGMENT_COMMITTING		0x02
+
+// words programmed per flash_commit_poll
+#define FLASH_COMMIT_WORDS				8
+
+typedef struct {
+	uint8_t data[BOOTLOADER_SEGMENT_SIZE];
+	uint32_t address;
+	uint16_t length;
+	uint16_t number;
+	uint8_t state;
+} __attribute__((aligned(4))) FlashSegment_TypeDef;
+
+FlashSegment_TypeDef flash_segments[BOOTLOADER_SEGMENT_BUFFERS];
+uint8_t flash_segment_fill = 0; // segment being received into
+uint8_t flash_segment_commit = 0; // oldest segment waiting to be written to flash
+uint16_t flash_segment_number = 0;
+uint32_t flash_write_base = 0; // start of the write, offsets are relative to it
+uint32_t flash_write_address = 0;
+FLASH_Status flash_commit_status = FLASH_COMPLETE;
+FlashProgram_TypeDef flash_program;
+
+// crc of the application body accumulated as each segment is committed, valid if the write started at the image header
+// and the body has been committed in order, it ends at the image length once the header has been committed
+CrcStream_TypeDef flash_crc_stream;
+uint32_t flash_crc_end = 0;
+bool flash_crc_valid = false;
+
+// segments of a multicast write not yet committed (bit n = segment n), reported to the host so it only resends those
+uint8_t flash_missing[(APPLICATION_SIZE / BOOTLOADER_SEGMENT_SIZE + 7) / 8];
+// commit reports aren't sent during a multicast write, committed segments are cleared from flash_missing instead
+bool can_write_quiet = false;
+// how the last multicast write ended, a node that dropped it ignores the repair pass and has to be sent the image again
+uint8_t can_multicast_session = MULTICAST_SESSION_NONE;
+
+// sectors erased since the last write (bit n = sector n), anything else is erased on demand before it is written
+uint16_t flash_erased_sectors = 0;
+
+// buffer of the segment being received into
+uint8_t * flash_buffer = flash_segments[0].data;
 uint16_t flash_buffer_index = 0;
 
+// compressed writes receive each packet here and decompress it into flash_buffer
+uint8_t lz_input[BOOTLOADER_SEGMENT_SIZE];
+LzDecoder_TypeDef flash_lz;
 
 
+
+typedef void (*poll_function)(void);
+
 int main(void);
 
 uint8_t usart_initialize(enum UsartBaudRate baud);
+uint8_t usart_initialize_rate(uint32_t baud_rate);
+uint32_t usart_baud_rate_of(enum UsartBaudRate baud);
+bool usart_rate_valid(uint32_t baud_rate);
+bool usart_speed_handshake(void);
+#if FEATURE_AUTOBAUD
+void usart_autobaud_start(void);
+void usart_autobaud_stop(void);
+uint32_t usart_autobaud_snap(uint32_t baud_rate);
+void EXTI15_10_IRQHandler(void);
+#else
+#define usart_autobaud_start()
+#define usart_autobaud_stop()
+#define usart_autobaud_snap(baud_rate)					(baud_rate)
+#endif
 bool usart_receive(uint16_t * data, bool wait);
+uint32_t usart_rx_position(void);
+void usart_discard(void);
 uint32_t usart_receive_32(void);
+uint16_t usart_receive_16(void);
 void usart_send_64(uint64_t data);
 void usart_send_32(uint32_t data);
 void usart_send_16(uint16_t data);
 void usart_send(uint8_t data);
+void usart_send_block(uint32_t address, uint32_t length);
+void usart_send_dma(uint32_t address, uint16_t length);
+void usart_flush(void);
+void usart_flush_wait(void);
 void usart_bootloader(void);
 void usart_ack(uint8_t command);
 void usart_nack(uint8_t command);
-void delay(int ticks);
+bool usart_write_receive(uint16_t * data);
+bool usart_write_receive_block(uint8_t * data, uint16_t length);
+void usart_write_poll(void);
+void delay(uint32_t ticks);
+void USART3_IRQHandler(void);
+void SysTick_Handler(void);
 
 uint8_t can_initialize(enum CanBaudRate baud);
+bool can_timing_valid(uint16_t prescaler, uint8_t bs1, uint8_t bs2, uint8_t sjw);
 bool can_receive(CanRxMsg * msg, bool wait);
 void can_send(CanTxMsg * msg, uint8_t command, uint8_t dlc);
+void can_tx_fill(void);
+void can_tx_abort(void);
+void can_flush(void);
+void CAN2_TX_IRQHandler(void);
+void can_rx_drain(void);
+void CAN2_RX0_IRQHandler(void);
+void CAN2_RX1_IRQHandler(void);
 void can_bootloader(void);
 void can_ack(uint8_t command);
 void can_nack(uint8_t command);
+void can_window_ack(uint8_t status, uint16_t sequence);
+bool can_write_receive(CanRxMsg * msg, uint32_t timeout);
+void can_write_poll(void);
+#if FEATURE_MULTICAST
+void can_multicast_status(uint16_t segments, uint16_t missing, uint8_t status);
+#endif
+
+void flash_write_begin(uint32_t address);
+void flash_write_queue(void);
+void flash_write_end(void);
+void flash_write_resume(void);
+#if FEATURE_COMPRESSED
+void flash_write_decompress_begin(uint32_t length);
+bool flash_write_decompress(uint8_t * data, uint32_t length, poll_function poll);
+#else
+#define flash_write_decompress_begin(length)
+#define flash_write_decompress(data, length, poll)		false
+#endif
+#if FEATURE_DELTA
+bool flash_write_delta_base(uint32_t crc);
+bool flash_write_keep(uint32_t length, bool last, poll_function poll);
+#else
+#define flash_write_delta_base(crc)						false
+#define flash_write_keep(length, last, poll)			false
+#endif
+bool flash_write_skip(uint32_t length, poll_function poll);
+bool flash_write_ready(void);
+bool flash_write_idle(void);
+bool flash_commit_poll(uint16_t * number, FLASH_Status * status, uint32_t * crc);
+bool flash_region_range(uint8_t region, uint32_t offset, uint32_t length, uint32_t * address);
+bool flash_region_read_range(uint8_t region, uint32_t offset, uint32_t length, uint32_t * address);
+bool flash_address_range(uint32_t address, uint32_t length);
+FLASH_Status flash_rewrite(uint32_t address, uint8_t * data, uint16_t length);
+void flash_crc_update(uint32_t address, uint32_t length);
+
+void journal_begin(uint8_t region, uint32_t length);
+bool journal_resume(uint8_t region, uint32_t length);
+void journal_commit(FlashSegment_TypeDef * segment);
+void journal_clear(void);
+void flash_user_data_written(void);
 
 FLASH_Status erase(uint8_t type);
+bool flash_erased(uint32_t address, uint32_t length);
+FLASH_Status flash_erase(uint32_t address, uint32_t length);
+uint8_t flash_sector_digest(uint32_t * crc);
 bool verify_application(void);
+bool verify_application_cached(void);
+bool verify_application_written(void);
+void verify_stamp(uint32_t crc, uint32_t length);
+void verify_invalidate(void);
 void execute_application(void);
 
 #endif /* BOOTLOADER_MAIN_H_ */